@@ -22,6 +22,10 @@
 
 #include "Compressor.h"
 
+#include <omp.h>
+
+BUF_POOL buf_pool;
+
 #ifdef __DEBUG_LOG__
 FILE *fp_log_debug = NULL;
 unsigned int debug_count = 0;
@@ -32,6 +36,57 @@ extern double under_T;
 extern double over_T;
 #endif
 
+/* -------------------------------------------------------------------------
+ * Input and output
+ */
+
+/*
+ * A blocking read that refuses to return truncated reads.
+ */
+ssize_t xread(int fd, char *buf, size_t count) {
+    ssize_t len, tlen;
+    tlen = 0;
+    do {
+        len = read(fd, buf, count);
+        if (len == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (len == 0)
+            return tlen;
+
+        buf += len;
+        count -= len;
+        tlen += len;
+    } while (count);
+
+    return tlen;
+}
+
+/*
+ * A blocking write that retries partial writes.
+ */
+ssize_t xwrite(int fd, const char *buf, size_t count) {
+    ssize_t len, tlen;
+    tlen = 0;
+    do {
+        len = write(fd, buf, count);
+        if (len == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        buf += len;
+        count -= len;
+        tlen += len;
+    } while (count);
+
+    return tlen;
+}
+
 /* -------------------------------------------------------------------------
  * Constructors and destructors
  */
@@ -41,22 +96,40 @@ Compressor::Compressor() {
     Compressor(NULL);
 }
 
-Compressor::Compressor(enano_params *p) {
-
-    cm = new context_models;
+/*
+ * Compressors that only code once the models are frozen don't need models of
+ * their own, own_models = false leaves cm to be set by use_models().
+ */
+Compressor::Compressor(enano_params *p, bool own_models) {
 
     B_CTX_LEN = p->llevel;
     B_CTX = (1 << (B_CTX_LEN * A_LOG));
     AVG_CANT = (B_CTX * Q_CTX);
     B_MASK = (B_CTX - 1);
-    NS_MODEL_SIZE = pow5[p->klevel];
-
-    for (uint i = 0; i < 256; i++)
-        not_nl[i] = 1;
-    not_nl['\r'] = not_nl['\n'] = 0;
+    seq_ctx2 = p->seq_ctx2;
+    NS_MODEL_SIZE = SEQ_MODEL_SIZE(p->klevel, seq_ctx2);
+    seq_k = p->klevel;
+    seq_lanes = MAX(p->seq_lanes, 1);
+    for (int b = 0; b < 5; b++)
+        seq_lead[b] = b * pow5[seq_k - 1];
 
     updateModel = true;
     maxCompression = p->max_comp;
+    rans = p->rans;
+    extract_first = p->extract_first;
+    extract_last = p->extract_last;
+    first_read = 0;
+
+    cm = NULL;
+    seq_dirty = NULL;
+    seq_synced = 0;
+    if (own_models) {
+        cm = new context_models;
+        cm->model_seq8 = new BASE_MODEL<uint8_t>[NS_MODEL_SIZE];
+        cm->seq_page_ver = NULL;
+        seq_dirty = new uint8_t[(NS_MODEL_SIZE >> SEQ_PAGE_SHIFT) + 1];
+        memset(seq_dirty, 0, (NS_MODEL_SIZE >> SEQ_PAGE_SHIFT) + 1);
+    }
 
     /* ACGTN* */
     for (int i = 0; i < 256; i++)
@@ -68,7 +141,6 @@ Compressor::Compressor(enano_params *p) {
     L['T'] = L['t'] = 3;
     L['N'] = L['n'] = 4;
 
-    cm->model_seq8 = new BASE_MODEL<uint8_t>[NS_MODEL_SIZE];
     ctx_avgs_sums = new uint16_t[AVG_CANT];
     ctx_avgs_err_sums = new uint16_t[AVG_CANT];
     ctx_err_avgs_total = new uint32_t[Q_CTX];
@@ -106,31 +178,52 @@ Compressor::Compressor(enano_params *p) {
     /* Length settings */
     last_len = 0;
 
+    blk_chunk = NULL;
+
+    clear_metrics();
+}
+
+void Compressor::clear_metrics() {
     name_in = name_out = 0;
     base_in = base_out = 0;
     qual_in = qual_out = 0;
     total_in = total_out = 0;
 }
 
+/* Readies a frozen model for the range coder, or for static rANS */
+template <class M>
+static inline void freeze_model(M &m, bool decode, bool rans) {
+    if (rans)
+        m.updateModelRans(decode);
+    else
+        m.updateModelAccFrecs(decode);
+}
+
 void Compressor::update_AccFreqs(context_models* ctx_m, bool decode){
     uint i;
     for (i = 0; i < 256; i++) {
-        ctx_m->model_name_prefix[i].updateModelAccFrecs(decode);
-        ctx_m->model_name_suffix[i].updateModelAccFrecs(decode);
-        ctx_m->model_name_len[i].updateModelAccFrecs(decode);
+        freeze_model(ctx_m->model_name_prefix[i], decode, rans);
+        freeze_model(ctx_m->model_name_suffix[i], decode, rans);
+        freeze_model(ctx_m->model_name_len[i], decode, rans);
     }
 
     for (i = 0; i < 8192; i++)
-        ctx_m->model_name_middle[i].updateModelAccFrecs(decode);
+        freeze_model(ctx_m->model_name_middle[i], decode, rans);
 
     for (i = 0; i < CTX_CNT; i++)
-        ctx_m->model_qual_quant[i].updateModelAccFrecs(decode);
-
-    ctx_m->quant_top.updateModelAccFrecs(decode);
-    ctx_m->model_len1.updateModelAccFrecs(decode);
-    ctx_m->model_len2.updateModelAccFrecs(decode);
-    ctx_m->model_len3.updateModelAccFrecs(decode);
-    ctx_m->model_same_len.updateModelAccFrecs(decode);
+        freeze_model(ctx_m->model_qual_quant[i], decode, rans);
+
+    freeze_model(ctx_m->quant_top, decode, rans);
+    freeze_model(ctx_m->model_len1, decode, rans);
+    freeze_model(ctx_m->model_len2, decode, rans);
+    freeze_model(ctx_m->model_len3, decode, rans);
+    freeze_model(ctx_m->model_same_len, decode, rans);
+
+    if (rans) {
+#pragma omp parallel for
+        for (int64_t c = 0; c < (int64_t) NS_MODEL_SIZE; c++)
+            ctx_m->model_seq8[c].normalizeRans();
+    }
 }
 
 void Compressor::soft_reset() {
@@ -144,17 +237,45 @@ void Compressor::soft_reset() {
     last_len = 0;
 }
 
+/*
+ * Only the pages of the sequence model that this Compressor updated, or that
+ * changed in ctx_m since the last copy, are copied. The rest are the same
+ * already, so the cost follows the contexts that the data actually uses.
+ */
 void Compressor::copy_stats(context_models* ctx_m){
-    //Save pointer cause its going to get modified by the next line
+    //Save pointers cause they are going to get modified by the next line
     BASE_MODEL<uint8_t>* model_seq8_ptr = cm->model_seq8;
+    uint32_t *seq_page_ver_ptr = cm->seq_page_ver;
     *cm = *(ctx_m);
     //Copy memory
-    memcpy(model_seq8_ptr, ctx_m->model_seq8, sizeof(BASE_MODEL<uint8_t>) * NS_MODEL_SIZE);
-    //Set pointer again
+    uint pages = (NS_MODEL_SIZE >> SEQ_PAGE_SHIFT) + 1;
+    for (uint pg = 0; pg < pages; pg++) {
+        if (seq_dirty[pg] || ctx_m->seq_page_ver[pg] > seq_synced) {
+            size_t first = (size_t) pg << SEQ_PAGE_SHIFT;
+            size_t cnt = MIN((size_t) 1 << SEQ_PAGE_SHIFT, NS_MODEL_SIZE - first);
+            memcpy(model_seq8_ptr + first, ctx_m->model_seq8 + first, sizeof(BASE_MODEL<uint8_t>) * cnt);
+            seq_dirty[pg] = 0;
+        }
+    }
+    seq_synced = ctx_m->seq_epoch;
+    //Set pointers again
     cm->model_seq8 = model_seq8_ptr;
+    cm->seq_page_ver = seq_page_ver_ptr;
+}
+
+void Compressor::use_models(context_models* ctx_m){
+    if (cm) {
+        delete [] cm->model_seq8;
+        delete cm;
+    }
+    delete [] seq_dirty;
+    seq_dirty = NULL;
+    cm = ctx_m;
+    updateModel = false;
 }
 
 Compressor::~Compressor() {
+    delete [] seq_dirty;
     delete [] ctx_avgs_sums;
     delete [] ctx_avgs_err_sums;
     delete [] ctx_err_avgs_total;
@@ -163,7 +284,8 @@ Compressor::~Compressor() {
 /* -------------------------------------------------------------------------
  * Name model
  */
-void Compressor::encode_name(RangeCoder *rc, char *name, int len) {
+template <int MODE, class RC>
+void Compressor::encode_name(RC *rc, char *name, int len) {
     int p_len, s_len; // prefix and suffix length
     int i, j, k, last_char;
 
@@ -183,21 +305,9 @@ void Compressor::encode_name(RangeCoder *rc, char *name, int len) {
     if (len - s_len - p_len < 0)
         s_len = len - p_len;
 
-    if (updateModel) {
-        if (maxCompression) {
-            cm->model_name_prefix[last_p_len].encodeSymbolOrder(rc, p_len);
-            cm->model_name_suffix[last_s_len].encodeSymbolOrder(rc, s_len);
-            cm->model_name_len[last_name_len].encodeSymbolOrder(rc, len);
-        } else {
-            cm->model_name_prefix[last_p_len].encodeSymbol(rc, p_len);
-            cm->model_name_suffix[last_s_len].encodeSymbol(rc, s_len);
-            cm->model_name_len[last_name_len].encodeSymbol(rc, len);
-        }
-    } else {
-        cm->model_name_prefix[last_p_len].encodeSymbolNoUpdate(rc, p_len);
-        cm->model_name_suffix[last_s_len].encodeSymbolNoUpdate(rc, s_len);
-        cm->model_name_len[last_name_len].encodeSymbolNoUpdate(rc, len);
-    }
+    CODING<MODE>::encode(cm->model_name_prefix[last_p_len], rc, p_len);
+    CODING<MODE>::encode(cm->model_name_suffix[last_s_len], rc, s_len);
+    CODING<MODE>::encode(cm->model_name_len[last_name_len], rc, len);
 
     last_p_len = p_len;
     last_s_len = s_len;
@@ -206,13 +316,7 @@ void Compressor::encode_name(RangeCoder *rc, char *name, int len) {
     for (i = j = p_len, k = 0; i < len2; i++, j++, k++) {
         last_char = ((last_name[j] - 32) * 2 + lc2 + k * 64) % 8192;
 
-        if (updateModel)
-            if (maxCompression)
-                cm->model_name_middle[last_char].encodeSymbolOrder(rc, name[i] & 0x7f);
-            else
-                cm->model_name_middle[last_char].encodeSymbol(rc, name[i] & 0x7f);
-        else
-            cm->model_name_middle[last_char].encodeSymbolNoUpdate(rc, name[i] & 0x7f);
+        CODING<MODE>::encode(cm->model_name_middle[last_char], rc, name[i] & 0x7f);
 
         if (name[i] == ' ' && last_name[j] != ' ') j++;
         if (name[i] != ' ' && last_name[j] == ' ') j--;
@@ -228,26 +332,15 @@ void Compressor::encode_name(RangeCoder *rc, char *name, int len) {
     last_name_len = len;
 }
 
-int Compressor::decode_name(RangeCoder *rc, char *name) {
+template <int MODE, class RC>
+int Compressor::decode_name(RC *rc, char *name) {
     int p_len, s_len, len; // prefix and suffix length
     int i, j, k;
     int last_char;
 
-    if (updateModel) {
-        if (maxCompression) {
-            p_len = cm->model_name_prefix[last_p_len].decodeSymbolOrder(rc);
-            s_len = cm->model_name_suffix[last_s_len].decodeSymbolOrder(rc);
-            len = cm->model_name_len[last_name_len].decodeSymbolOrder(rc);
-        } else {
-            p_len = cm->model_name_prefix[last_p_len].decodeSymbol(rc);
-            s_len = cm->model_name_suffix[last_s_len].decodeSymbol(rc);
-            len = cm->model_name_len[last_name_len].decodeSymbol(rc);
-        }
-    } else {
-        p_len = cm->model_name_prefix[last_p_len].decodeSymbolNoUpdate(rc);
-        s_len = cm->model_name_suffix[last_s_len].decodeSymbolNoUpdate(rc);
-        len = cm->model_name_len[last_name_len].decodeSymbolNoUpdate(rc);
-    }
+    p_len = CODING<MODE>::decode(cm->model_name_prefix[last_p_len], rc);
+    s_len = CODING<MODE>::decode(cm->model_name_suffix[last_s_len], rc);
+    len = CODING<MODE>::decode(cm->model_name_len[last_name_len], rc);
 
     last_p_len = p_len;
     last_s_len = s_len;
@@ -261,13 +354,7 @@ int Compressor::decode_name(RangeCoder *rc, char *name) {
 
         last_char = ((last_name[j] - 32) * 2 + lc2 + k * 64) % 8192;
 
-        if (updateModel)
-            if (maxCompression)
-                c = cm->model_name_middle[last_char].decodeSymbolOrder(rc);
-            else
-                c = cm->model_name_middle[last_char].decodeSymbol(rc);
-        else
-            c = cm->model_name_middle[last_char].decodeSymbolNoUpdate(rc);
+        c = CODING<MODE>::decode(cm->model_name_middle[last_char], rc);
 
         //c = 'x';
         name[i] = c;
@@ -294,72 +381,28 @@ int Compressor::decode_name(RangeCoder *rc, char *name) {
 /* -------------------------------------------------------------------------
  * Sequence length model
  */
-void Compressor::encode_len(RangeCoder *rc, int len) {
-    if (updateModel) {
-        if (maxCompression) {
-            if (len != last_len) {
-                cm->model_same_len.encodeSymbolOrder(rc, 0);
-                cm->model_len1.encodeSymbolOrder(rc, len & 0xff);
-                cm->model_len2.encodeSymbolOrder(rc, (len >> 8) & 0xff);
-                cm->model_len3.encodeSymbolOrder(rc, (len >> 16) & 0xff);
-            } else {
-                cm->model_same_len.encodeSymbolOrder(rc, 1);
-            }
-        } else {
-            if (len != last_len) {
-                cm->model_same_len.encodeSymbol(rc, 0);
-                cm->model_len1.encodeSymbol(rc, len & 0xff);
-                cm->model_len2.encodeSymbol(rc, (len >> 8) & 0xff);
-                cm->model_len3.encodeSymbol(rc, (len >> 16) & 0xff);
-            } else {
-                cm->model_same_len.encodeSymbol(rc, 1);
-            }
-        }
+template <int MODE, class RC>
+void Compressor::encode_len(RC *rc, int len) {
+    if (len != last_len) {
+        CODING<MODE>::encode(cm->model_same_len, rc, 0);
+        CODING<MODE>::encode(cm->model_len1, rc, len & 0xff);
+        CODING<MODE>::encode(cm->model_len2, rc, (len >> 8) & 0xff);
+        CODING<MODE>::encode(cm->model_len3, rc, (len >> 16) & 0xff);
     } else {
-        if (len != last_len) {
-            cm->model_same_len.encodeSymbolNoUpdate(rc, 0);
-            cm->model_len1.encodeSymbolNoUpdate(rc, len & 0xff);
-            cm->model_len2.encodeSymbolNoUpdate(rc, (len >> 8) & 0xff);
-            cm->model_len3.encodeSymbolNoUpdate(rc, (len >> 16) & 0xff);
-        } else {
-            cm->model_same_len.encodeSymbolNoUpdate(rc, 1);
-        }
+        CODING<MODE>::encode(cm->model_same_len, rc, 1);
     }
 }
 
-int Compressor::decode_len(RangeCoder *rc) {
-    if (updateModel) {
-        if (maxCompression) {
-            if (cm->model_same_len.decodeSymbolOrder(rc)) {
-                return last_len;
-            } else {
-                int l1 = cm->model_len1.decodeSymbolOrder(rc);
-                int l2 = cm->model_len2.decodeSymbolOrder(rc);
-                int l3 = cm->model_len3.decodeSymbolOrder(rc);
-                last_len = l1 + (l2 << 8) + (l3 << 16);
-                return last_len;
-            }
-        } else {
-            if (cm->model_same_len.decodeSymbol(rc)) {
-                return last_len;
-            } else {
-                int l1 = cm->model_len1.decodeSymbol(rc);
-                int l2 = cm->model_len2.decodeSymbol(rc);
-                int l3 = cm->model_len3.decodeSymbol(rc);
-                last_len = l1 + (l2 << 8) + (l3 << 16);
-                return last_len;
-            }
-        }
+template <int MODE, class RC>
+int Compressor::decode_len(RC *rc) {
+    if (CODING<MODE>::decode(cm->model_same_len, rc)) {
+        return last_len;
     } else {
-        if (cm->model_same_len.decodeSymbolNoUpdate(rc)) {
-            return last_len;
-        } else {
-            int l1 = cm->model_len1.decodeSymbolNoUpdate(rc);
-            int l2 = cm->model_len2.decodeSymbolNoUpdate(rc);
-            int l3 = cm->model_len3.decodeSymbolNoUpdate(rc);
-            last_len = l1 + (l2 << 8) + (l3 << 16);
-            return last_len;
-        }
+        int l1 = CODING<MODE>::decode(cm->model_len1, rc);
+        int l2 = CODING<MODE>::decode(cm->model_len2, rc);
+        int l3 = CODING<MODE>::decode(cm->model_len3, rc);
+        last_len = l1 + (l2 << 8) + (l3 << 16);
+        return last_len;
     }
 }
 
@@ -367,43 +410,152 @@ int Compressor::decode_len(RangeCoder *rc) {
 /* -------------------------------------------------------------------------
  * Sequence model
  */
-void Compressor::encode_seq8(RangeCoder *rc, char *seq, int len) {
+template <int MODE, class RC>
+void Compressor::encode_seq8(RC *rc, char *seq, int len) {
     int last;
-    // Corresponds to a sequence of NS consecutive 'N'
-    last = NS_MODEL_SIZE - 1;
+    // Corresponds to a sequence of NS consecutive 'N', or 'A' with 2 bit contexts
+    last = seq_ctx2 ? 0 : NS_MODEL_SIZE - 1;
+    // Last bases coded, base i at hist[i & 15], starting with the 'N's of the context
+    unsigned char hist[16];
+    memset(hist, 4, sizeof(hist));
 
     for (int i = 0; i < len; i++) {
 
         unsigned char b = L[(unsigned char) seq[i]];
-        if (updateModel)
+        if (MODE != CODE_FROZEN) {
             cm->model_seq8[last].encodeSymbol(rc, b);
-        else
+            seq_dirty[last >> SEQ_PAGE_SHIFT] = 1;
+        } else
             cm->model_seq8[last].encodeSymbolNoUpdate(rc, b);
 
-        last = UPDATE_CONTEXT(last, b);
+        last = seq_ctx2 ? UPDATE_CONTEXT2(last, b) : UPDATE_CONTEXT(last, b, hist[(i - seq_k) & 15]);
+        hist[i & 15] = b;
     }
 
 }
 
-void Compressor::decode_seq8(RangeCoder *rc, char *seq, int len) {
+template <int MODE, class RC>
+void Compressor::decode_seq8(RC *rc, char *seq, int len) {
     int last;
     const char *dec = "ACGTN";
 
-    // Corresponds to a sequence of NS consecutive 'N'
-    last = NS_MODEL_SIZE - 1;
+    // Corresponds to a sequence of NS consecutive 'N', or 'A' with 2 bit contexts
+    last = seq_ctx2 ? 0 : NS_MODEL_SIZE - 1;
+    unsigned char hist[16];
+    memset(hist, 4, sizeof(hist));
 
     for (int i = 0; i < len; i++) {
         unsigned char b;
-        if (updateModel)
+        if (MODE != CODE_FROZEN) {
             b = cm->model_seq8[last].decodeSymbol(rc);
-        else
+            seq_dirty[last >> SEQ_PAGE_SHIFT] = 1;
+        } else
             b = cm->model_seq8[last].decodeSymbolNoUpdate(rc);
         *seq++ = dec[b];
-        last = UPDATE_CONTEXT(last, b);
+        last = seq_ctx2 ? UPDATE_CONTEXT2(last, b) : UPDATE_CONTEXT(last, b, hist[(i - seq_k) & 15]);
+        hist[i & 15] = b;
     }
 
 }
 
+/*
+ * Interleaved coding of the sequence stream. Read i goes to lane i % seq_lanes
+ * and every lane has its own range coder. The lanes take turns to code one
+ * base each, so there are seq_lanes independent chains of model lookups and
+ * the model entry of the next base of a lane is prefetched while the other
+ * lanes code theirs, overlapping the cache misses on large models.
+ * The bases of read i are at base + seq_off_a[i].
+ */
+struct SEQ_LANE {
+    int read;         // Read being coded, >= ns once the lane is done
+    int pos, len;
+    uint ctx;
+    char *seq;
+    unsigned char hist[16];
+};
+
+/* Decodes the base of context ctx into *c */
+template <int MODE, class RC>
+inline unsigned char Compressor::code_lane_base(RC *rc, uint ctx, char *c, std::true_type) {
+    unsigned char b;
+    if (MODE != CODE_FROZEN) {
+        b = cm->model_seq8[ctx].decodeSymbol(rc);
+        seq_dirty[ctx >> SEQ_PAGE_SHIFT] = 1;
+    } else
+        b = cm->model_seq8[ctx].decodeSymbolNoUpdate(rc);
+    *c = "ACGTN"[b];
+    return b;
+}
+
+/* Encodes the base *c in context ctx */
+template <int MODE, class RC>
+inline unsigned char Compressor::code_lane_base(RC *rc, uint ctx, char *c, std::false_type) {
+    unsigned char b = L[(unsigned char) *c];
+    if (MODE != CODE_FROZEN) {
+        cm->model_seq8[ctx].encodeSymbol(rc, b);
+        seq_dirty[ctx >> SEQ_PAGE_SHIFT] = 1;
+    } else
+        cm->model_seq8[ctx].encodeSymbolNoUpdate(rc, b);
+    return b;
+}
+
+template <bool DECODE, int MODE, class RC>
+void Compressor::code_seq_lanes(RC *rcs, char *base) {
+    const uint first_ctx = seq_ctx2 ? 0 : NS_MODEL_SIZE - 1;
+    SEQ_LANE lanes[MAX_SEQ_LANES];
+    /* Every lane, even one without reads, leaves once it runs out of reads */
+    int active = seq_lanes;
+
+    for (int l = 0; l < seq_lanes; l++) {
+        lanes[l].read = l - seq_lanes;
+        lanes[l].pos = lanes[l].len = 0;
+    }
+
+    while (active > 0) {
+        for (int l = 0; l < seq_lanes; l++) {
+            SEQ_LANE *ln = &lanes[l];
+            if (ln->read >= ns)
+                continue;
+
+            /* Move on to the next read of the lane */
+            bool moved = false;
+            while (ln->pos == ln->len) {
+                moved = true;
+                ln->read += seq_lanes;
+                if (ln->read >= ns)
+                    break;
+                ln->pos = 0;
+                ln->len = seq_len_a[ln->read];
+                ln->ctx = first_ctx;
+                ln->seq = base + seq_off_a[ln->read];
+                memset(ln->hist, 4, sizeof(ln->hist));
+            }
+            if (DECODE && moved) {
+                /* The reads before the oldest one in the lanes are decoded */
+                int done = ns;
+                for (int k = 0; k < seq_lanes; k++)
+                    done = MIN(done, lanes[k].read);
+                if (done > 0)
+                    seq_ready.store(done, std::memory_order_release);
+            }
+            if (ln->read >= ns) {
+                active--;
+                continue;
+            }
+
+            uint last = ln->ctx;
+            unsigned char b = code_lane_base<MODE>(&rcs[l], last, ln->seq + ln->pos,
+                                             std::integral_constant<bool, DECODE>());
+
+            last = seq_ctx2 ? UPDATE_CONTEXT2(last, b) : UPDATE_CONTEXT(last, b, ln->hist[(ln->pos - seq_k) & 15]);
+            ln->hist[ln->pos & 15] = b;
+            ln->pos++;
+            ln->ctx = last;
+            __builtin_prefetch(&cm->model_seq8[last]);
+        }
+    }
+}
+
 /* -------------------------------------------------------------------------
  * Quality model
  */
@@ -468,7 +620,8 @@ inline uint Compressor::get_context(unsigned char b, unsigned char q1, unsigned
 }
 
 
-void Compressor::encode_qual(RangeCoder *rc, char *seq, char *qual, int len) {
+template <int MODE, class RC>
+void Compressor::encode_qual(RC *rc, char *seq, char *qual, int len) {
     int i, next_b;
     next_b = 1 + B_CTX_LEN/2;
     uint B_prev_ctx = 0, Q_prev_ctx = 0, ctx = 0;
@@ -485,47 +638,17 @@ void Compressor::encode_qual(RangeCoder *rc, char *seq, char *qual, int len) {
     for (i = 0; i < len; i++, next_b++) {
         q1 = (qual[i] - '!') & (QMAX - 1);
 
-        if (updateModel) {
-            if (maxCompression) {
-                if (q1 < QUANT_D_MAX) {
-                    #ifdef __GLOBAL_STATS__
-                    under_T++;
-                    #endif
-                    cm->model_qual_quant[ctx].encodeSymbolOrder(rc, q1);
-                } else {
-                    #ifdef __GLOBAL_STATS__
-                    over_T++;
-                    #endif
-                    cm->model_qual_quant[ctx].encodeSymbolOrder(rc, QUANT_D_MAX);
-                    cm->quant_top.encodeSymbolOrder(rc, q1 - QUANT_D_MAX);
-                }
-            } else {
-                if (q1 < QUANT_D_MAX) {
-                    #ifdef __GLOBAL_STATS__
-                    under_T++;
-                    #endif
-                    cm->model_qual_quant[ctx].encodeSymbol(rc, q1);
-                } else {
-                    #ifdef __GLOBAL_STATS__
-                    over_T++;
-                    #endif
-                    cm->model_qual_quant[ctx].encodeSymbol(rc, QUANT_D_MAX);
-                    cm->quant_top.encodeSymbol(rc, q1 - QUANT_D_MAX);
-                }
-            }
+        if (q1 < QUANT_D_MAX) {
+            #ifdef __GLOBAL_STATS__
+            under_T++;
+            #endif
+            CODING<MODE>::encode(cm->model_qual_quant[ctx], rc, q1);
         } else {
-            if (q1 < QUANT_D_MAX) {
-                #ifdef __GLOBAL_STATS__
-                under_T++;
-                #endif
-                cm->model_qual_quant[ctx].encodeSymbolNoUpdate(rc, q1);
-            } else {
-                    #ifdef __GLOBAL_STATS__
-                    over_T++;
-                    #endif
-                cm->model_qual_quant[ctx].encodeSymbolNoUpdate(rc, QUANT_D_MAX);
-                cm->quant_top.encodeSymbolNoUpdate(rc, q1 - QUANT_D_MAX);
-            }
+            #ifdef __GLOBAL_STATS__
+            over_T++;
+            #endif
+            CODING<MODE>::encode(cm->model_qual_quant[ctx], rc, QUANT_D_MAX);
+            CODING<MODE>::encode(cm->quant_top, rc, q1 - QUANT_D_MAX);
         }
 #ifdef  __CONTEXT_STATS__
         context_stats[ctx][0] += 1; //Add one to the total
@@ -544,7 +667,8 @@ void Compressor::encode_qual(RangeCoder *rc, char *seq, char *qual, int len) {
     }
 }
 
-void Compressor::decode_qual(RangeCoder *rc, char *seq, char *qual, int len) {
+template <int MODE, class RC>
+void Compressor::decode_qual(RC *rc, char *seq, char *qual, int len) {
     int i;
     int q1 = 0, q2 = 0;
     int next_b = 1 + B_CTX_LEN / 2;
@@ -560,23 +684,9 @@ void Compressor::decode_qual(RangeCoder *rc, char *seq, char *qual, int len) {
     for (i = 0; i < len; i++, next_b++) {
         unsigned q1;
 
-        if (updateModel) {
-            if (maxCompression) {
-                q1 = (unsigned char) cm->model_qual_quant[ctx].decodeSymbolOrder(rc);
-                if (q1 == QUANT_D_MAX) {
-                    q1 += (unsigned char) cm->quant_top.decodeSymbolOrder(rc);
-                }
-            } else {
-                q1 = (unsigned char) cm->model_qual_quant[ctx].decodeSymbol(rc);
-                if (q1 == QUANT_D_MAX) {
-                    q1 += (unsigned char) cm->quant_top.decodeSymbol(rc);
-                }
-            }
-        } else {
-            q1 = (unsigned char) cm->model_qual_quant[ctx].decodeSymbolNoUpdate(rc);
-            if (q1 == QUANT_D_MAX) {
-                q1 += (unsigned char) cm->quant_top.decodeSymbolNoUpdate(rc);
-            }
+        q1 = (unsigned char) CODING<MODE>::decode(cm->model_qual_quant[ctx], rc);
+        if (q1 == QUANT_D_MAX) {
+            q1 += (unsigned char) CODING<MODE>::decode(cm->quant_top, rc);
         }
 #ifdef __DEBUG_LOG__
         fprintf(fp_log_debug, "ctx: %d\tq2: %d, q1: %d, dif_qual: %d\n", (int) ctx, (int) q2, (int) q1, (int) dif_qual);
@@ -601,203 +711,283 @@ void Compressor::decode_qual(RangeCoder *rc, char *seq, char *qual, int len) {
  */
 
 /* Sequence length & name */
+template <int MODE, class RC>
+void Compressor::compress_r0(void) {
+    RC rc;
+    rc.output(out0);
+    rc.StartEncode();
+    for (int i = 0; i < ns; i++) {
+        encode_len<MODE>(&rc, seq_len_a[i]);
+    }
+    rc.FinishEncode();
+    sz0 = rc.size_out();
+}
+
+template <int MODE, class RC>
 void Compressor::compress_r1() {
-    char *name_p = name_buf;
-    RangeCoder rc;
+    uint64_t name_total = 0;
+    RC rc;
 
     rc.output(out1);
     rc.StartEncode();
 
     for (int i = 0; i < ns; i++) {
-        encode_name(&rc, name_p, name_len_a[i]);
-        name_p += name_len_a[i];
+        encode_name<MODE>(&rc, name_src + name_off_a[i], name_len_a[i]);
+        name_total += name_len_a[i];
     }
 
     rc.FinishEncode();
 
     sz1 = rc.size_out();
-    name_in += name_p - name_buf;
+    name_in += name_total;
     name_out += sz1;
 }
 
 /* Sequence itself */
+template <int MODE, class RC>
 void Compressor::compress_r2() {
-    char *seq_p = seq_buf;
-    RangeCoder rc;
+    uint64_t seq_total = 0;
+    RC rc;
+
+    if (seq_lanes > 1) {
+        compress_r2_lanes<MODE, RC>();
+        return;
+    }
 
     rc.output(out2);
     rc.StartEncode();
     for (int i = 0; i < ns; i++) {
-        encode_seq8(&rc, seq_p, seq_len_a[i]);
-        seq_p += seq_len_a[i];
+        encode_seq8<MODE>(&rc, seq_src + seq_off_a[i], seq_len_a[i]);
+        seq_total += seq_len_a[i];
     }
     rc.FinishEncode();
 
     sz2 = rc.size_out();
-    base_in += seq_p - seq_buf;
+    base_in += seq_total;
+    base_out += sz2;
+}
+
+/*
+ * The sequence stream in lanes starts with the sizes of all the lanes but
+ * the last one, 4 bytes each, followed by the lanes.
+ */
+template <int MODE, class RC>
+void Compressor::compress_r2_lanes() {
+    RC rcs[MAX_SEQ_LANES];
+    size_t lane_off[MAX_SEQ_LANES + 1];
+    uint64_t seq_total = 0;
+
+    /* Each lane gets room for its bound in out2 */
+    lane_off[0] = 0;
+    for (int l = 0; l < seq_lanes; l++) {
+        uint64_t lane_total = 0;
+        for (int i = l; i < ns; i += seq_lanes)
+            lane_total += seq_len_a[i];
+        seq_total += lane_total;
+        lane_off[l + 1] = lane_off[l] + RC_OUT_BOUND(lane_total);
+    }
+    char *out = out2.reserve(4 * (seq_lanes - 1) + lane_off[seq_lanes]);
+    char *lanes_out = out + 4 * (seq_lanes - 1);
+
+    for (int l = 0; l < seq_lanes; l++) {
+        rcs[l].output(lanes_out + lane_off[l]);
+        rcs[l].StartEncode();
+    }
+    code_seq_lanes<false, MODE>(rcs, seq_src);
+
+    /* Pack the lanes after their sizes, each one moves back at most its
+     * unused bound */
+    char *out_p = lanes_out;
+    for (int l = 0; l < seq_lanes; l++) {
+        rcs[l].FinishEncode();
+        int sz = rcs[l].size_out();
+        if (l < seq_lanes - 1) {
+            out[4 * l + 0] = (sz >> 0) & 0xff;
+            out[4 * l + 1] = (sz >> 8) & 0xff;
+            out[4 * l + 2] = (sz >> 16) & 0xff;
+            out[4 * l + 3] = (sz >> 24) & 0xff;
+        }
+        memmove(out_p, lanes_out + lane_off[l], sz);
+        out_p += sz;
+    }
+
+    sz2 = out_p - out;
+    base_in += seq_total;
     base_out += sz2;
 }
 
 /* Quality values */
+template <int MODE, class RC>
 void Compressor::compress_r3() {
 
-    char *qual_p = qual_buf;
-    char *seq_p = seq_buf;
-    RangeCoder rc;
+    uint64_t qual_total = 0;
+    RC rc;
 
     rc.output(out3);
     rc.StartEncode();
 
     for (int i = 0; i < ns; i++) {
-        encode_qual(&rc, seq_p, qual_p, seq_len_a[i]);
-        qual_p += seq_len_a[i];
-        seq_p += seq_len_a[i];
+        encode_qual<MODE>(&rc, seq_src + seq_off_a[i], qual_src + qual_off_a[i], seq_len_a[i]);
+        qual_total += seq_len_a[i];
     }
 
     rc.FinishEncode();
 
     sz3 = rc.size_out();
-    qual_in += qual_p - qual_buf;
+    qual_in += qual_total;
     qual_out += sz3;
 }
 
 
 /*
- * Reads from in[0..in_len-1] and writes a compressed copy to out, setting
- * *out_len to the returned size. The caller needs to ensure out is large
- * enough.
+ * Parses the complete reads of in[0..in_len-1] into the name, sequence and
+ * quality offset arrays. The offsets point straight into in[], which has to
+ * outlive the compression of the block.
  *
- * We can only compress entire sequences and in[] may end in a partial
- * sequence. Hence *in_end is set to a pointer to the end of the processed
- * buffer.
+ * We can only compress entire reads and in[] may end in a partial read, unless
+ * at_eof is set, in which case the last read may miss its final newline.
+ * Also fills ns with the number of reads parsed.
  *
- * Also returns *nseqs filled out.
+ * Lines are split with the vectorised NL_SCANNER. Quality lines are not
+ * split, they are skipped using the length of their sequence and only
+ * checked for a newline, so a short one is never taken for a whole one.
  *
- * Returns total compressed length on success, with data in out[]
- *        -1 on failure
+ * Returns the length of the parsed prefix of in[] on success
+ *        -1 if a read does not start with '@'
+ *        -2 if the separator line does not start with '+'
+ *        -3 if a quality line is not as long as its sequence
  */
-int Compressor::fq_parse_reads(char* in_buf, int in_len,
-                               char **in_end, int *nseqs, int *remainder_length, int &end) {
-    char *in = &in_buf[0];
-    end = 0;
-    int end_hash = 0;
-    int i, j;
+int Compressor::fq_parse_reads(char *in, int in_len, bool at_eof) {
+    int end = 0;
 
-    char *name_p = name_buf;
-    char *seq_p = seq_buf;
-    char *qual_p = qual_buf;
+    name_src = seq_src = qual_src = in;
 
     ns = 0;
 
     /* Parse and separate into name, seq, qual buffers */
     seq_len = 0;
 
-    uint len;
+    /* The shortest read, "@\nA\n+\nA\n", takes 8 bytes */
+    size_t max_reads = in_len / 8 + 1;
+    name_len_a.reserve(max_reads);
+    seq_len_a.reserve(max_reads);
+    name_off_a.reserve(max_reads);
+    seq_off_a.reserve(max_reads);
+    qual_off_a.reserve(max_reads);
+
+    NL_SCANNER nl(in, in_len);
 
-    for (i = 0; i < in_len;) {
+    for (int i = 0; i < in_len;) {
         /* Name */
         if (in[i] != '@')
             return -1;
 
-        j = i;
-        i++;
-        while (i < in_len && not_nl[(uc) in[i]])
-            i++;
-
-        len = i - j - 1;
-        name_len_a[ns] = len;
-        memcpy(name_p, &in[j+1],len * sizeof(char));
-        name_p += len;
-
-        if (++i >= in_len)
+        int name_end = nl.next();
+        if (name_end >= in_len)
             break;
 
         /* Sequence */
-        for (j = i; i < in_len && not_nl[(uc) in[i]]; i++);
-
-        len = i - j;
-        seq_len_a[ns] = len;
-        memcpy(seq_p, &in[j],len * sizeof(char));
-        seq_p += len;
-
-        if (++i >= in_len)
+        int seq_start = name_end + 1;
+        int seq_end = nl.next();
+        if (seq_end >= in_len)
             break;
 
         /* +name, assume to be identical to @name */
-        if (in[i] != '+')
+        int plus_start = seq_end + 1;
+        if (plus_start >= in_len)
+            break;
+        if (in[plus_start] != '+')
             return -2;
 
-        for (; i < in_len && not_nl[(uc) in[i]]; i++);
-        if (++i >= in_len)
+        int plus_end = nl.next();
+        if (plus_end >= in_len)
             break;
 
-        /* Quality */
-        if (i + seq_len_a[ns] > in_len){
-            i = in_len + 1;
+        /* Quality, followed by a newline unless it is the last read */
+        int len = seq_end - seq_start;
+        int qual_start = plus_end + 1;
+        int qual_end = qual_start + len;
+        if (qual_end > in_len || (qual_end == in_len && !at_eof))
             break;
-        }
+        if ((qual_end < in_len && in[qual_end] != '\n') || memchr(in + qual_start, '\n', len))
+            return -3;
 
-        memcpy(qual_p, &in[i], seq_len_a[ns] * sizeof(char));
-        qual_p += seq_len_a[ns];
-        i += seq_len_a[ns];
-
-        if (++i > in_len)
-            break;
+        name_len_a[ns] = name_end - i - 1;
+        seq_len_a[ns] = len;
+        name_off_a[ns] = i + 1;
+        seq_off_a[ns] = seq_start;
+        qual_off_a[ns] = qual_start;
 
-        end = i;
-        end_hash = i;
+        /* The quality line needs no scanning */
+        i = qual_end + 1;
+        nl.seek(i);
+        end = MIN(i, in_len);
 
         if (seq_len == 0)
-            seq_len = seq_len_a[ns];
-        else if (seq_len != seq_len_a[ns])
+            seq_len = len;
+        else if (seq_len != len)
             seq_len = -1;
 
         ns++;
     }
 
-    *in_end = in + end_hash;
-
-    /* rl = first_pos - last_pos + 1
-     (we dont add 1 because last pos is already one more than needed) */
-    *remainder_length = i - end_hash;
-
-    if (i == BLK_SIZE)
-        *remainder_length += 1;
+    return end;
+}
 
-    *nseqs = ns;
+/* Codes the four streams of the block with coders of type RC */
+template <int MODE, class RC>
+void Compressor::compress_streams() {
+    /*
+     * Inside a parallel region the tasks go to the team of the caller, whose
+     * threads only steal them at an implicit barrier or taskwait, as in the
+     * training loops, not while they wait on the queues of the pipelines.
+     */
+    if (omp_in_parallel())
+        compress_tasks<MODE, RC>();
+    else {
+#pragma omp parallel
+#pragma omp single
+        compress_tasks<MODE, RC>();
+    }
+}
 
-    return 0;
+/* Every stream of the block is a task of its own */
+template <int MODE, class RC>
+void Compressor::compress_tasks() {
+#pragma omp task
+    compress_r0<MODE, RC>();
+#pragma omp task
+    compress_r1<MODE, RC>();
+#pragma omp task
+    compress_r2<MODE, RC>();
+#pragma omp task
+    compress_r3<MODE, RC>();
+#pragma omp taskwait
 }
 
 int Compressor::fq_compress(){
-    /* Encode seq len, we have a dependency on this for seq/qual */
-    char *out = out_buf + 4;
-    RangeCoder rc;
-    rc.output(out0);
-    rc.StartEncode();
+    size_t name_total = 0, seq_total = 0;
     for (int i = 0; i < ns; i++) {
-        encode_len(&rc, seq_len_a[i]);
-    }
-    rc.FinishEncode();
-    sz0 = rc.size_out();
-
-#pragma omp parallel sections
-    {
-#pragma omp section
-        {
-            compress_r1();
-        }
-#pragma omp section
-        {
-            compress_r2();
-        }
-#pragma omp section
-        {
-            compress_r3();
-        }
+        name_total += name_len_a[i];
+        seq_total += seq_len_a[i];
     }
+    out0.reserve(RC_OUT_BOUND(4 * ns));
+    out1.reserve(RC_OUT_BOUND(name_total + 4 * ns));
+    out2.reserve(RC_OUT_BOUND(seq_total));
+    out3.reserve(RC_OUT_BOUND(2 * seq_total));
+
+    /* Once the models are frozen they can be coded with static rANS */
+    if (updateModel && maxCompression)
+        compress_streams<CODE_ORDER, RangeCoder>();
+    else if (updateModel)
+        compress_streams<CODE_ADAPTIVE, RangeCoder>();
+    else if (rans)
+        compress_streams<CODE_FROZEN, RANS_ENC>();
+    else
+        compress_streams<CODE_FROZEN, RangeCoder>();
 
     /* Concatenate compressed output into a single block */
+    char *out = out_buf.reserve(4 + 20 + sz0 + sz1 + sz2 + sz3) + 4;
     char *out_p = out;
 
     *out_p++ = (ns >> 0) & 0xff;  /* Number of sequences */
@@ -844,50 +1034,122 @@ int Compressor::fq_compress(){
 
     comp_len = out_p - out;
 
+    /* The streams and the parsed reads are not needed anymore */
+    out0.release();
+    out1.release();
+    out2.release();
+    out3.release();
+    release_reads();
+
     return 0;
 }
 /* --------------------------------------------------------------------------
  * Decompression functions.
  */
 
+template <int MODE, class RC>
+void Compressor::decompress_r0(void) {
+    RC rc;
+    rc.input(in_buf0);
+    rc.StartDecode();
+
+    size_t seq_total = 0;
+    for (int i = 0; i < ns; i++) {
+        seq_len_a[i] = decode_len<MODE>(&rc);
+        seq_total += seq_len_a[i];
+    }
+    rc.FinishDecode();
+
+    seq_buf.reserve(seq_total);
+    qual_buf.reserve(seq_total);
+}
+
+template <int MODE, class RC>
 void Compressor::decompress_r1(void) {
-    RangeCoder rc;
+    RC rc;
     rc.input(in_buf1);
     rc.StartDecode();
 
-    char *name_p = name_buf;
+    size_t name_off = 0;
 
     for (int i = 0; i < ns; i++) {
+        char *name_p = name_buf.grow(name_off + MAX_NAME_LINE, name_off) + name_off;
         *name_p++ = '@';
-        name_p += decode_name(&rc, name_p);
+        name_len_a[i] = decode_name<MODE>(&rc, name_p);
+        name_p += name_len_a[i];
         *name_p++ = '\n';
+        name_off += name_len_a[i] + 2;
     }
 
     rc.FinishDecode();
 }
 
+template <int MODE, class RC>
 void Compressor::decompress_r2(void) {
-    RangeCoder rc;
+    RC rc;
+
+    if (seq_lanes > 1) {
+        decompress_r2_lanes<MODE, RC>();
+        return;
+    }
+
     rc.input(in_buf2);
     rc.StartDecode();
 
     char *seq_p = seq_buf;
     for (int i = 0; i < ns; i++) {
-        decode_seq8(&rc, seq_p, seq_len_a[i]);
+        decode_seq8<MODE>(&rc, seq_p, seq_len_a[i]);
         seq_p += seq_len_a[i];
+        seq_ready.store(i + 1, std::memory_order_release);
     }
     rc.FinishDecode();
 }
 
+template <int MODE, class RC>
+void Compressor::decompress_r2_lanes(void) {
+    RC rcs[MAX_SEQ_LANES];
+
+    unsigned char *sizes = (unsigned char *) in_buf2;
+    char *in = in_buf2 + 4 * (seq_lanes - 1);
+    for (int l = 0; l < seq_lanes; l++) {
+        rcs[l].input(in);
+        rcs[l].StartDecode();
+        if (l < seq_lanes - 1)
+            in += DECODE_INT(sizes + 4 * l);
+    }
+
+    seq_off_a.reserve(ns);
+    int off = 0;
+    for (int i = 0; i < ns; i++) {
+        seq_off_a[i] = off;
+        off += seq_len_a[i];
+    }
+
+    code_seq_lanes<true, MODE>(rcs, seq_buf);
+    seq_ready.store(ns, std::memory_order_release);
+}
+
+/* Waits until the bases of read i are decoded, ready caches the last count seen */
+inline void Compressor::wait_seq_ready(int i, int &ready) {
+    while (i >= ready) {
+        ready = seq_ready.load(std::memory_order_acquire);
+        if (i >= ready)
+            std::this_thread::yield();
+    }
+}
+
+template <int MODE, class RC>
 void Compressor::decompress_r3(void) {
-    RangeCoder rc;
+    RC rc;
     rc.input(in_buf3);
     rc.StartDecode();
 
     char *seq_p = seq_buf;
     char *qual_p = qual_buf;
+    int ready = 0;
     for (int i = 0; i < ns; i++) {
-        decode_qual(&rc, seq_p, qual_p, seq_len_a[i]);
+        wait_seq_ready(i, ready);
+        decode_qual<MODE>(&rc, seq_p, qual_p, seq_len_a[i]);
         qual_p += seq_len_a[i];
         seq_p += seq_len_a[i];
     }
@@ -897,7 +1159,6 @@ void Compressor::decompress_r3(void) {
 /* Decompress a single block */
 void Compressor::fq_decompress() {
 
-    char *name_p, *seq_p, *qual_p;
     char *in = decode_buf;
     uint32_t nseqs = DECODE_INT((unsigned char *) (in));
     uint32_t sz0 = DECODE_INT((unsigned char *) (in + 4));
@@ -924,57 +1185,192 @@ void Compressor::fq_decompress() {
     in_buf3 = in;
     in += sz3;
 
-    RangeCoder rc0;
-    rc0.input(in_buf0);
-    rc0.StartDecode();
+    if (updateModel && maxCompression)
+        decompress_streams<CODE_ORDER, RangeCoder>();
+    else if (updateModel)
+        decompress_streams<CODE_ADAPTIVE, RangeCoder>();
+    else if (rans)
+        decompress_streams<CODE_FROZEN, RANS_DEC>();
+    else
+        decompress_streams<CODE_FROZEN, RangeCoder>();
+
+    decode_buf.release();
+
+    /* Only the reads of the -x range are laid out, first_read places the block */
+    uint64_t first = first_read, last = first_read + ns;
+    if (extract_last) {
+        last = MAX(MIN(extract_last, last), first_read);
+        first = MIN(MAX(extract_first, first_read), last);
+    }
+    assemble_output(first - first_read, last - first_read);
+}
 
-    for (int i = 0; i < ns; i++)
-        seq_len_a[i] = decode_len(&rc0);
-    rc0.FinishDecode();
+/* Decodes the four streams of the block with coders of type RC */
+template <int MODE, class RC>
+void Compressor::decompress_streams() {
+    seq_len_a.reserve(ns);
+    name_len_a.reserve(ns);
+    name_buf.reserve((size_t) ns * 64);
+
+    if (omp_in_parallel())
+        decompress_tasks<MODE, RC>();
+    else {
+#pragma omp parallel
+#pragma omp single
+        decompress_tasks<MODE, RC>();
+    }
+}
 
-#pragma omp parallel sections
+/*
+ * Every stream of the block is a task of its own, the bases and the qualities
+ * wait for the lengths. The qualities are decoded one read behind the bases
+ * they take their contexts from, and the first of the two tasks to start
+ * takes the bases, so the qualities never wait on bases no thread decodes.
+ */
+template <int MODE, class RC>
+void Compressor::decompress_tasks() {
+    std::atomic<bool> seq_taken(false);
+    seq_ready.store(0, std::memory_order_relaxed);
+    char lens; // Dependency on the lengths, never accessed
+
+#pragma omp task depend(out: lens)
+    decompress_r0<MODE, RC>();
+#pragma omp task
+    decompress_r1<MODE, RC>();
+#pragma omp task depend(in: lens) shared(seq_taken)
     {
-#pragma omp section
-        {
-            decompress_r1();
-        }
-#pragma omp section
-        {
-            decompress_r2();
-            decompress_r3();
-        }
+        if (!seq_taken.exchange(true))
+            decompress_r2<MODE, RC>();
+    }
+#pragma omp task depend(in: lens) shared(seq_taken)
+    {
+        if (!seq_taken.exchange(true))
+            decompress_r2<MODE, RC>();
+        decompress_r3<MODE, RC>();
     }
+#pragma omp taskwait
+}
 
-    /* Stick together the arrays into out_buf */
-    out_ind = 0;
-    name_p = name_buf;
-    seq_p = seq_buf;
-    qual_p = qual_buf;
+static char SEP_PLUS[] = "\n+\n";
 
-    for (int i = 0; i < ns; i++) {
-        /* name */
-        char *aux_name_p = name_p;
-        while ((out_buf[out_ind++] = *name_p++) != '\n');
+/*
+ * Lays out the FASTQ text of the reads [first, last) of the decoded block.
+ * Blocks of long reads are described as an iovec list pointing into name_buf,
+ * seq_buf and qual_buf, so the text is only copied by the kernel in
+ * write_output(). Blocks of many short reads would need too many iovecs and
+ * are copied into out_buf a field at a time.
+ */
+void Compressor::assemble_output(int first, int last) {
+    char *name_p = name_buf;
+    char *seq_p = seq_buf;
+    char *qual_p = qual_buf;
+
+    for (int i = 0; i < first; i++) {
+        name_p += name_len_a[i] + 2;
+        seq_p += seq_len_a[i];
+        qual_p += seq_len_a[i];
+    }
+
+    int cnt = last - first;
+    uncomp_len = 0;
+    for (int i = first; i < last; i++) {
+#ifdef DUPLICATE_NAME_LINES
+        uncomp_len += 2 * name_len_a[i] + 2 * seq_len_a[i] + 6;
+#else
+        uncomp_len += name_len_a[i] + 2 * seq_len_a[i] + 6;
+#endif
+    }
 
-        /* seq */
-        for (int j = 0; j < seq_len_a[i]; j++)
-            out_buf[out_ind++] = *seq_p++;
+    out_iov_cnt = 0;
+    if (cnt > 0 && cnt <= OUT_IOV_READS && uncomp_len / cnt >= OUT_IOV_MIN_RECORD) {
+        struct iovec *iov = out_iov.reserve(6 * cnt);
+        for (int i = first; i < last; i++) {
+            int name_len = name_len_a[i] + 2;   // '@' and '\n'
+            int len = seq_len_a[i];
 
-        out_buf[out_ind++] = '\n';
-        out_buf[out_ind++] = '+';
+            iov->iov_base = name_p;   iov++->iov_len = name_len;
+            iov->iov_base = seq_p;    iov++->iov_len = len;
 #ifdef DUPLICATE_NAME_LINES
-        while ((out_buf[out_ind++] = *(++aux_name_p)) != '\n');
+            iov->iov_base = SEP_PLUS; iov++->iov_len = 2;
+            iov->iov_base = name_p + 1; iov++->iov_len = name_len - 1;
 #else
-        out_buf[out_ind++] = '\n';
+            iov->iov_base = SEP_PLUS; iov++->iov_len = 3;
 #endif
-        /* qual */
-        for (int j = 0; j < seq_len_a[i]; j++) {
-            out_buf[out_ind++] = *qual_p++;
+            iov->iov_base = qual_p;   iov++->iov_len = len;
+            iov->iov_base = SEP_PLUS + 2; iov++->iov_len = 1;
+
+            name_p += name_len;
+            seq_p += len;
+            qual_p += len;
         }
-        out_buf[out_ind++] = '\n';
+        out_iov_cnt = iov - out_iov;
+        return;
     }
 
-    uncomp_len = out_ind;
+    char *out = out_buf.reserve(uncomp_len);
+    for (int i = first; i < last; i++) {
+        int name_len = name_len_a[i] + 2;
+        int len = seq_len_a[i];
+
+        memcpy(out, name_p, name_len);
+        out += name_len;
+        memcpy(out, seq_p, len);
+        out += len;
+        *out++ = '\n';
+        *out++ = '+';
+#ifdef DUPLICATE_NAME_LINES
+        memcpy(out, name_p + 1, name_len - 1);
+        out += name_len - 1;
+#else
+        *out++ = '\n';
+#endif
+        memcpy(out, qual_p, len);
+        out += len;
+        *out++ = '\n';
+
+        name_p += name_len;
+        seq_p += len;
+        qual_p += len;
+    }
+}
+
+/* Writes the block laid out by assemble_output() and releases its buffers. */
+bool Compressor::write_output(int out_fd) {
+    bool ok = write_iov(out_fd);
+    out_buf.release();
+    out_iov.release();
+    name_buf.release();
+    seq_buf.release();
+    qual_buf.release();
+    release_reads();
+    return ok;
+}
+
+bool Compressor::write_iov(int out_fd) {
+    if (out_iov_cnt == 0)
+        return xwrite(out_fd, out_buf, uncomp_len) == uncomp_len;
+
+    struct iovec *iov = out_iov;
+    int cnt = out_iov_cnt;
+    while (cnt > 0) {
+        ssize_t sz = writev(out_fd, iov, MIN(cnt, IOV_MAX));
+        if (sz == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        /* Skip what was written, the last piece may be partially written */
+        while (cnt > 0 && (size_t) sz >= iov->iov_len) {
+            sz -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + sz;
+            iov->iov_len -= sz;
+        }
+    }
+    return true;
 }
 
 bool Compressor::output_block(int out_fd){
@@ -984,7 +1380,16 @@ bool Compressor::output_block(int out_fd){
     out_buf[3] = (comp_len >> 24) & 0xff;
     comp_len += 4;
 
-    int sz = write(out_fd, out_buf, comp_len);
+    int sz = xwrite(out_fd, out_buf, comp_len);
     total_out += sz;
+    out_buf.release();
     return (sz == comp_len) ;
 }
+
+void Compressor::release_reads() {
+    name_len_a.release();
+    seq_len_a.release();
+    name_off_a.release();
+    seq_off_a.release();
+    qual_off_a.release();
+}
@@ -32,6 +32,8 @@
 #ifndef WIN32
 
 #include <unistd.h>
+#include <sys/uio.h>
+#include <limits.h>
 
 #else
 #include "unistd.h"
@@ -43,12 +45,19 @@
 #include <math.h>
 #include <errno.h>
 #include <time.h>
+#include <type_traits>
+#include <atomic>
+#include <thread>
 
 /* Range Coder:
  * This is using Eugene Shelwien's code from coders6c2.zip.
  */
 #include "clr.h"
 
+#include "fastq_scan.h" // NL_SCANNER
+#include "buffers.h"    // GROW_BUF
+#include "rans.h"       // RANS_ENC, RANS_DEC
+
 /*
  * Order 0 models, optimsed for various sizes of alphabet.
  * order0_coder is the original Dmitry Shkarin code, tweaked a bit to
@@ -82,7 +91,54 @@
 
 
 #define DECODE_INT(a) ((a)[0] + ((a)[1]<<8) + ((a)[2]<<16) + ((a)[3]<<24))
-#define UPDATE_CONTEXT(ctx, b) ((ctx*5 + b) % NS_MODEL_SIZE)
+/* Same as ((ctx*5 + b) % NS_MODEL_SIZE) without the division: lead is the
+ * base leaving the context, k bases ago, and seq_lead[lead] its weight */
+#define UPDATE_CONTEXT(ctx, b, lead) ((ctx - seq_lead[lead]) * 5 + b)
+#define UPDATE_CONTEXT2(ctx, b) (((ctx << 2) + (b & 3)) & (NS_MODEL_SIZE - 1))
+struct fq_chunk;
+struct model_file;
+struct block_index;
+
+/*
+ * Coding policy of a block: adaptive models kept ordered by frequency in max
+ * compression mode, adaptive models while fast mode trains, and frozen ones
+ * after it. The coding functions of a block are templates on the policy, so
+ * it is picked once per block instead of at every symbol.
+ */
+enum { CODE_ORDER, CODE_ADAPTIVE, CODE_FROZEN };
+
+template <int MODE>
+struct CODING;
+
+template <>
+struct CODING<CODE_ORDER> {
+    template <class M, class RC>
+    static inline void encode(M &m, RC *rc, uint sym) { m.encodeSymbolOrder(rc, sym); }
+    template <class M, class RC>
+    static inline uint decode(M &m, RC *rc) { return m.decodeSymbolOrder(rc); }
+};
+
+template <>
+struct CODING<CODE_ADAPTIVE> {
+    template <class M, class RC>
+    static inline void encode(M &m, RC *rc, uint sym) { m.encodeSymbol(rc, sym); }
+    template <class M, class RC>
+    static inline uint decode(M &m, RC *rc) { return m.decodeSymbol(rc); }
+};
+
+template <>
+struct CODING<CODE_FROZEN> {
+    template <class M, class RC>
+    static inline void encode(M &m, RC *rc, uint sym) { m.encodeSymbolNoUpdate(rc, sym); }
+    template <class M, class RC>
+    static inline uint decode(M &m, RC *rc) { return m.decodeSymbolNoUpdate(rc); }
+};
+
+/* Blocking read and write that only return short counts at EOF or on error,
+ * as needed to work on pipes. */
+ssize_t xread(int fd, char *buf, size_t count);
+ssize_t xwrite(int fd, const char *buf, size_t count);
+
 /*
  * enano parameter block.
  */
@@ -93,6 +149,18 @@ typedef struct {
     bool max_comp;
     uint8_t blk_upd_freq;
     uint8_t blk_upd_thresh;
+    uint32_t blk_size;
+    bool seq_ctx2;      // -a, 2 bit sequence contexts
+    uint8_t seq_lanes;  // -L, interleaved lanes of the sequence stream
+    bool rans;          // -r, static rANS once the models are frozen
+    uint8_t mc_streams; // -p, parallel streams of max compression mode
+    uint8_t mc_sync;    // rounds of blocks between mixes of the streams
+    const char *save_model; // --save-model, file to save the trained models to
+    model_file *model;      // --model, trained models to start from, NULL to train
+    bool embed_model;       // --embed-model, the archive holds its models and its blocks decode on their own
+    block_index *index;     // --index, the blocks written so far, or the index of the archive to decode, NULL without one
+    uint64_t extract_first; // -x, reads [extract_first, extract_last) to decode, counted from 0
+    uint64_t extract_last;  // 0 to decode all the reads
 } enano_params;
 
 typedef struct {
@@ -102,6 +170,9 @@ typedef struct {
     SIMPLE_MODEL<256> model_len3;
     SIMPLE_MODEL<2> model_same_len;
     BASE_MODEL<uint8_t>* model_seq8;
+    // Training mix in which each page of model_seq8 last changed, only kept by the shared models
+    uint32_t *seq_page_ver;
+    uint32_t seq_epoch;
 
     // Names
     SIMPLE_MODEL<256> model_name_prefix[256];
@@ -121,7 +192,7 @@ class Compressor {
 public:
     Compressor();
 
-    Compressor(enano_params *p);
+    Compressor(enano_params *p, bool own_models = true);
 
     ~Compressor();
 
@@ -130,36 +201,75 @@ public:
     //Copies the statistical stats from cmp to this
     void copy_stats(context_models* ctx_m);
 
+    //Drops the models of this Compressor and codes with the frozen ctx_m
+    void use_models(context_models* ctx_m);
+
     /* Compression metrics */
     uint64_t base_in, base_out;
     uint64_t qual_in, qual_out;
     uint64_t name_in, name_out;
     uint64_t total_in, total_out;
 
+    void clear_metrics();
+
+    template <int MODE, class RC>
+    void compress_r0();
+
+    template <int MODE, class RC>
     void compress_r1();
 
+    template <int MODE, class RC>
     void compress_r2();
 
+    template <int MODE, class RC>
+    void compress_r2_lanes();
+
+    template <int MODE, class RC>
     void compress_r3();
 
+    template <int MODE, class RC>
+    void decompress_r0();
+
+    template <int MODE, class RC>
     void decompress_r1();
 
+    template <int MODE, class RC>
     void decompress_r2();
 
+    template <int MODE, class RC>
+    void decompress_r2_lanes();
+
+    template <int MODE, class RC>
     void decompress_r3();
 
+    void wait_seq_ready(int i, int &ready);
+
     bool output_block(int out_fd);
+
+    bool write_output(int out_fd);
+
+    bool write_iov(int out_fd);
+
+    void release_reads();
 //protected:
     /* --- Parameters passed into the constructor */
     bool updateModel, maxCompression;
+    bool rans;
+    bool seq_ctx2;
+    uint64_t extract_first, extract_last; // -x range, as in enano_params
+    int seq_k;
+    uint seq_lead[5]; // Weight of each base as the oldest one of a context
+    int seq_lanes;
+
+    // Pages of model_seq8 updated since the last copy_stats(), and the shared models epoch copied
+    uint8_t *seq_dirty;
+    uint32_t seq_synced;
 
     context_models * cm;
 
     uint AVG_CANT, B_CTX, B_MASK, B_CTX_LEN, NS_MODEL_SIZE;
 
-    char not_nl[256];
-
-    char* decode_buf;
+    GROW_BUF<char> decode_buf;
 
     int L[256];          // Sequence table lookups ACGTN->0..4
 
@@ -182,23 +292,42 @@ public:
                                     15 ,15 ,15 ,15 ,15 ,15 ,15 ,15 ,15 ,15 ,15 ,15 ,15 ,15 ,15 ,15};
 
     /* --- Buffers */
-    // Input and output buffers; Output buffer needs to be more than BLK_SIZE
-    char out_buf[BLK_SIZE + BLK_SIZE / 2];
+    // Grown to the size of each block and released once it is written
+    GROW_BUF<char> out_buf; // Compressed block, or FASTQ text of a decoded block
     int out_ind; // index into out_buf.
+    // Decoded output as pieces of the decode buffers, out_iov_cnt is 0 if it is in out_buf
+    GROW_BUF<struct iovec> out_iov;
+    int out_iov_cnt;
     int comp_len;
     int uncomp_len;
+    uint64_t blk_id; // Position of the block in the stream
+    uint64_t first_read; // Ordinal of the first read of the block, for the -x range
 
     int ns;
     int seq_len;
-    char name_buf[BLK_SIZE/4];
-    char seq_buf[BLK_SIZE];
-    char qual_buf[BLK_SIZE];
-    int name_len_a[BLK_SIZE / 9];
-    int seq_len_a[BLK_SIZE / 9];
-    char out0[BLK_SIZE]; // seq_len
-    char out1[BLK_SIZE]; // name
-    char out2[BLK_SIZE]; // seq
-    char out3[BLK_SIZE]; // qual
+    GROW_BUF<char> name_buf;
+    GROW_BUF<char> seq_buf;
+    GROW_BUF<char> qual_buf;
+    GROW_BUF<int> name_len_a;
+    GROW_BUF<int> seq_len_a;
+    // Reads of the block whose bases are decoded, the quality stream decodes behind it
+    std::atomic<int> seq_ready;
+    // Fields of each read, as offsets into the input block
+    GROW_BUF<int> name_off_a;
+    GROW_BUF<int> seq_off_a;
+    GROW_BUF<int> qual_off_a;
+    char *name_src, *seq_src, *qual_src;
+
+    // Input block to parse, a slice of the mapped file or of a read chunk
+    char *blk_in;
+    int blk_in_len;
+    bool blk_at_eof;
+    fq_chunk *blk_chunk;
+    // Compressed streams, only held while compressing
+    GROW_BUF<char> out0; // seq_len
+    GROW_BUF<char> out1; // name
+    GROW_BUF<char> out2; // seq
+    GROW_BUF<char> out3; // qual
     int sz0, sz1, sz2, sz3;
     char *in_buf0, *in_buf1, *in_buf2, *in_buf3;
 
@@ -206,22 +335,37 @@ public:
     // Sequence length
     int last_len;
 
-    void encode_len(RangeCoder *rc, int len);
+    template <int MODE, class RC>
+    void encode_len(RC *rc, int len);
 
-    int decode_len(RangeCoder *rc);
+    template <int MODE, class RC>
+    int decode_len(RC *rc);
 
     char last_name[1024]; // Last name
     int last_name_len;    // Length of last name
     int last_p_len;       // Length of last common prefix
     int last_s_len;       // Length of last common suffix
 
-    void encode_name(RangeCoder *rc, char *name, int len);
+    template <int MODE, class RC>
+    void encode_name(RC *rc, char *name, int len);
 
-    int decode_name(RangeCoder *rc, char *name);
+    template <int MODE, class RC>
+    int decode_name(RC *rc, char *name);
 
-    void encode_seq8(RangeCoder *rc, char *seq, int len);
+    template <int MODE, class RC>
+    void encode_seq8(RC *rc, char *seq, int len);
 
-    void decode_seq8(RangeCoder *rc, char *seq, int len);
+    template <int MODE, class RC>
+    void decode_seq8(RC *rc, char *seq, int len);
+
+    template <bool DECODE, int MODE, class RC>
+    void code_seq_lanes(RC *rcs, char *base);
+
+    template <int MODE, class RC>
+    inline unsigned char code_lane_base(RC *rc, uint ctx, char *c, std::true_type);
+
+    template <int MODE, class RC>
+    inline unsigned char code_lane_base(RC *rc, uint ctx, char *c, std::false_type);
 
     // Quality
     uint16_t* ctx_avgs_sums;
@@ -236,18 +380,33 @@ public:
 
     inline uint get_context(unsigned char s, unsigned char q1, unsigned char q2, uint &s_prev_ctx, uint &Q_prev_ctx);
 
-    void encode_qual(RangeCoder *rc, char *seq, char *qual, int len);
+    template <int MODE, class RC>
+    void encode_qual(RC *rc, char *seq, char *qual, int len);
 
-    void decode_qual(RangeCoder *rc, char *seq, char *qual, int len);
+    template <int MODE, class RC>
+    void decode_qual(RC *rc, char *seq, char *qual, int len);
     /* --- Main functions for compressing and decompressing blocks */
-    /* Parses full reads into buffers from in. Returns remainder read length.*/
-    int fq_parse_reads(char* in_buf, int in_len,
-                       char **in_end, int *nseqs, int *remainder_length, int &end);
+    /* Parses full reads from in. Returns the length of the parsed prefix.*/
+    int fq_parse_reads(char *in, int in_len, bool at_eof);
 
     int fq_compress();
 
     void fq_decompress();
 
+    template <int MODE, class RC>
+    void compress_streams();
+
+    template <int MODE, class RC>
+    void compress_tasks();
+
+    template <int MODE, class RC>
+    void decompress_streams();
+
+    template <int MODE, class RC>
+    void decompress_tasks();
+
+    void assemble_output(int first, int last);
+
     void update_AccFreqs(context_models* ctx_m, bool decode);
 
 };
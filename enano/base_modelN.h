@@ -24,13 +24,14 @@ struct BASE_MODEL {
     BASE_MODEL(int *start);
     void reset();
     void reset(int *start);
-    inline void encodeSymbol(RangeCoder *rc, uint sym);
-    inline void encodeSymbolNoUpdate(RangeCoder *rc, uint sym);
+    template <class RC> inline void encodeSymbol(RC *rc, uint sym);
+    template <class RC> inline void encodeSymbolNoUpdate(RC *rc, uint sym);
     inline void updateModel(uint sym);
     inline void mix(BASE_MODEL* cm);
-    inline void mix_array(void**models, uc len);
-    inline uint decodeSymbol(RangeCoder *rc);
-    inline uint decodeSymbolNoUpdate(RangeCoder *rc);
+    inline void mix_array(BASE_MODEL **models, uint idx, uint len);
+    template <class RC> inline uint decodeSymbol(RC *rc);
+    template <class RC> inline uint decodeSymbolNoUpdate(RC *rc);
+    inline void normalizeRans(void);
     inline uint getTopSym(void);
     inline uint getSummFreq(void);
 
@@ -79,7 +80,8 @@ void BASE_MODEL<st_t>::rescaleRare()
 #define GetFreq256 GetFreq
 
 template <typename st_t>
-inline void BASE_MODEL<st_t>::encodeSymbol(RangeCoder *rc, uint sym) {
+template <class RC>
+inline void BASE_MODEL<st_t>::encodeSymbol(RC *rc, uint sym) {
     int SummFreq = (Stats[0] + Stats[1]) + (Stats[2] + Stats[3]) + Stats[4];
     if ( SummFreq>=WSIZ ) {
 	rescaleRare();
@@ -113,7 +115,8 @@ inline void BASE_MODEL<st_t>::encodeSymbol(RangeCoder *rc, uint sym) {
 }
 
 template <typename st_t>
-inline void BASE_MODEL<st_t>::encodeSymbolNoUpdate(RangeCoder *rc, uint sym) {
+template <class RC>
+inline void BASE_MODEL<st_t>::encodeSymbolNoUpdate(RC *rc, uint sym) {
 
     int SummFreq = (Stats[0] + Stats[1]) + (Stats[2] + Stats[3]) + Stats[4];
 
@@ -160,23 +163,38 @@ inline void BASE_MODEL<st_t>::mix(BASE_MODEL<st_t>* m) {
     }
 }
 
+/* Averages the models idx of the len model arrays */
 template <typename st_t>
-inline void BASE_MODEL<st_t>::mix_array(void**models, uc len)
+inline void BASE_MODEL<st_t>::mix_array(BASE_MODEL<st_t> **models, uint idx, uint len)
 {
-    for (int i = 0; i < 5; i++) {
-        uint fmix = 0;
-        for (uc c = 0; c < len; c++) {
-            fmix += ((BASE_MODEL<st_t>*)models[c])->Stats[i];
-        }
-        fmix = round((double)fmix/len);
-        Stats[i] = fmix;
+    uint fmix[5] = {0, 0, 0, 0, 0};
+    for (uint c = 0; c < len; c++) {
+        const st_t *m = models[c][idx].Stats;
+        for (int i = 0; i < 5; i++)
+            fmix[i] += m[i];
     }
+    for (int i = 0; i < 5; i++)
+        Stats[i] = MIX_ROUND(fmix[i], len);
     int SummFreq = (Stats[0] + Stats[1]) + (Stats[2] + Stats[3]) + Stats[4];
     if (SummFreq >= WSIZ) {
         rescaleRare();
     }
 }
 
+/*
+ * Scales the stats to add up to 256, the power of two that the static rANS
+ * coder needs. They are below WSIZ already, so little precision is lost.
+ */
+template <typename st_t>
+inline void BASE_MODEL<st_t>::normalizeRans(void) {
+    uint32_t f[5];
+    for (int i = 0; i < 5; i++)
+        f[i] = Stats[i];
+    rans_normalize(f, 5, 256);
+    for (int i = 0; i < 5; i++)
+        Stats[i] = f[i];
+}
+
 /*
  * Returns the bias of the best symbol compared to all other symbols.
  * This is a measure of how well adapted this model thinks it is to the
@@ -195,7 +213,8 @@ inline uint BASE_MODEL<st_t>::getSummFreq(void) {
 }
 
 template <typename st_t>
-inline uint BASE_MODEL<st_t>::decodeSymbol(RangeCoder *rc) {
+template <class RC>
+inline uint BASE_MODEL<st_t>::decodeSymbol(RC *rc) {
 
     int SummFreq = (Stats[0] + Stats[1]) + (Stats[2] + Stats[3]) + Stats[4];
 
@@ -238,7 +257,8 @@ inline uint BASE_MODEL<st_t>::decodeSymbol(RangeCoder *rc) {
 }
 
 template <typename st_t>
-inline uint BASE_MODEL<st_t>::decodeSymbolNoUpdate(RangeCoder *rc) {
+template <class RC>
+inline uint BASE_MODEL<st_t>::decodeSymbolNoUpdate(RC *rc) {
     int SummFreq = (Stats[0] + Stats[1]) + (Stats[2] + Stats[3]) + Stats[4];
 
     uint count=rc->GetFreq256(SummFreq);
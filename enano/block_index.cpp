@@ -0,0 +1,235 @@
+// MIT License
+
+// Copyright (c) 2020 Guillermo Dufort y Álvarez
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "Compressor.h"
+#include "block_index.h"
+
+#include <sys/stat.h>
+#include <zlib.h>
+
+static inline void put_le(unsigned char *p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static inline uint64_t get_le(const unsigned char *p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+        v |= (uint64_t) p[i] << (8 * i);
+    return v;
+}
+
+/* pread() of count bytes, only short at the end of the file or on error */
+static ssize_t xpread(int fd, char *buf, size_t count, uint64_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t sz = pread(fd, buf + done, count - done, offset + done);
+        if (sz == -1 && errno == EINTR)
+            continue;
+        if (sz <= 0)
+            return done ? (ssize_t) done : sz;
+        done += sz;
+    }
+    return done;
+}
+
+void index_start(block_index *idx, uint64_t offset) {
+    idx->entries.clear();
+    idx->next_offset = offset;
+    idx->next_read = 0;
+}
+
+void index_add(block_index *idx, uint32_t comp_len, uint32_t ns, uint64_t uncomp_len) {
+    index_entry e = {idx->next_offset, comp_len, ns, idx->next_read, uncomp_len};
+    idx->entries.push_back(e);
+    idx->next_offset += 4 + (uint64_t) comp_len;
+    idx->next_read += ns;
+}
+
+void index_skip(block_index *idx, uint64_t bytes) {
+    idx->next_offset += bytes;
+}
+
+int write_index(int fd, block_index *idx) {
+    size_t n = idx->entries.size();
+    size_t len = 4 + n * INDEX_ENTRY_LEN + INDEX_TRAILER_LEN;
+    unsigned char *out = new unsigned char[len];
+
+    put_le(out, 0, 4);
+    unsigned char *p = out + 4;
+    for (size_t i = 0; i < n; i++) {
+        index_entry *e = &idx->entries[i];
+        put_le(p, e->offset, 8);
+        put_le(p + 8, e->comp_len, 4);
+        put_le(p + 12, e->ns, 4);
+        put_le(p + 16, e->first_read, 8);
+        put_le(p + 24, e->uncomp_len, 8);
+        p += INDEX_ENTRY_LEN;
+    }
+    put_le(p, idx->next_offset + 4, 8);
+    put_le(p + 8, n, 8);
+    put_le(p + 16, crc32(0, out + 4, n * INDEX_ENTRY_LEN), 4);
+    memcpy(p + 20, INDEX_MAGIC, 4);
+
+    int res = 0;
+    if (xwrite(fd, (char *) out, len) != (ssize_t) len) {
+        printf( "Abort: truncated write.\n");
+        res = -1;
+    }
+    delete [] out;
+    return res;
+}
+
+int read_index(int fd, block_index *idx) {
+    struct stat st;
+    unsigned char trailer[INDEX_TRAILER_LEN];
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        printf( "Abort: the archive must be a regular file to use its index.\n");
+        return -1;
+    }
+    uint64_t size = st.st_size;
+    if (size < INDEX_TRAILER_LEN
+        || xpread(fd, (char *) trailer, INDEX_TRAILER_LEN, size - INDEX_TRAILER_LEN) != INDEX_TRAILER_LEN
+        || memcmp(trailer + 20, INDEX_MAGIC, 4) != 0) {
+        printf( "Abort: the archive has no block index.\n");
+        return -1;
+    }
+
+    uint64_t first = get_le(trailer, 8);
+    uint64_t n = get_le(trailer + 8, 8);
+    if (first > size - INDEX_TRAILER_LEN || (size - INDEX_TRAILER_LEN - first) / INDEX_ENTRY_LEN != n
+        || (size - INDEX_TRAILER_LEN - first) % INDEX_ENTRY_LEN != 0) {
+        printf( "Abort: corrupt block index.\n");
+        return -1;
+    }
+
+    size_t len = n * INDEX_ENTRY_LEN;
+    unsigned char *in = new unsigned char[len + 1];
+    int res = -1;
+    if ((size_t) xpread(fd, (char *) in, len, first) != len) {
+        printf( "Abort: truncated read.\n");
+    } else if (crc32(0, in, len) != get_le(trailer + 16, 4)) {
+        printf( "Abort: corrupt block index.\n");
+    } else {
+        idx->entries.resize(n);
+        const unsigned char *p = in;
+        for (uint64_t i = 0; i < n; i++) {
+            index_entry *e = &idx->entries[i];
+            e->offset = get_le(p, 8);
+            e->comp_len = get_le(p + 8, 4);
+            e->ns = get_le(p + 12, 4);
+            e->first_read = get_le(p + 16, 8);
+            e->uncomp_len = get_le(p + 24, 8);
+            p += INDEX_ENTRY_LEN;
+        }
+        idx->next_offset = first - 4;
+        idx->next_read = n ? idx->entries[n - 1].first_read + idx->entries[n - 1].ns : 0;
+        res = 0;
+    }
+    delete [] in;
+    return res;
+}
+
+uint64_t index_find_read(block_index *idx, uint64_t read) {
+    uint64_t lo = 0, hi = idx->entries.size();
+    /* First block whose reads end after read */
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        index_entry *e = &idx->entries[mid];
+        if (e->first_read + e->ns <= read)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int locate_blocks(int fd, bool indexed, uint64_t reads, block_index *idx) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return 1;
+    off_t cur = lseek(fd, 0, SEEK_CUR);
+    if (cur == -1)
+        return 1;
+    uint64_t offset = cur;
+
+    if (indexed) {
+        if (read_index(fd, idx) != 0)
+            return -1;
+        /* Drop the blocks already read */
+        size_t b = 0;
+        while (b < idx->entries.size() && idx->entries[b].offset < offset)
+            b++;
+        bool at_end = b == idx->entries.size();
+        if ((at_end ? idx->next_offset : idx->entries[b].offset) != offset
+            || (at_end ? idx->next_read : idx->entries[b].first_read) != reads) {
+            printf( "Abort: corrupt block index.\n");
+            return -1;
+        }
+        idx->entries.erase(idx->entries.begin(), idx->entries.begin() + b);
+        return 0;
+    }
+
+    index_start(idx, offset);
+    idx->next_read = reads;
+    uint64_t size = st.st_size;
+    /* The length of the block and its number of reads */
+    unsigned char len_buf[8];
+    while (offset < size) {
+        ssize_t sz = xpread(fd, (char *) len_buf, 8, offset);
+        if (sz < 4) {
+            printf( "Abort: truncated read.\n");
+            return -1;
+        }
+        uint64_t comp_len = get_le(len_buf, 4);
+        /* End of blocks mark */
+        if (comp_len == 0)
+            break;
+        if (comp_len < 4 || comp_len > INT32_MAX) {
+            printf( "Abort: corrupt block length %lu.\n", (unsigned long) comp_len);
+            return -1;
+        }
+        if (comp_len > size - offset - 4) {
+            printf( "Abort: truncated read.\n");
+            return -1;
+        }
+        index_add(idx, comp_len, get_le(len_buf + 4, 4), 0);
+        offset = idx->next_offset;
+    }
+    return 0;
+}
+
+bool load_indexed_block(int fd, block_index *idx, uint64_t b, Compressor *c) {
+    index_entry *e = &idx->entries[b];
+    unsigned char len_buf[4];
+    if (xpread(fd, (char *) len_buf, 4, e->offset) != 4 || get_le(len_buf, 4) != e->comp_len) {
+        printf( "Abort: block %lu does not match the index.\n", (unsigned long) b);
+        return false;
+    }
+    ssize_t sz = xpread(fd, c->decode_buf.reserve(e->comp_len), e->comp_len, e->offset + 4);
+    if (sz != (ssize_t) e->comp_len) {
+        printf( "Abort: truncated read.\n");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,105 @@
+// MIT License
+
+// Copyright (c) 2020 Guillermo Dufort y Álvarez
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+/*
+ * Index of the blocks of an archive, see --index.
+ *
+ * The encoder records every block it writes, and after the last one writes
+ * an end of blocks mark, a block length of 0, followed by the index:
+ *
+ *   entry of every block, INDEX_ENTRY_LEN bytes each:
+ *     offset of its 4 byte length in the archive (8 bytes)
+ *     compressed length, without the 4 bytes (4 bytes)
+ *     number of reads (4 bytes)
+ *     ordinal of its first read in the archive, from 0 (8 bytes)
+ *     length of its FASTQ text in the input (8 bytes)
+ *   trailer, INDEX_TRAILER_LEN bytes:
+ *     offset of the first entry (8 bytes)
+ *     number of blocks (8 bytes)
+ *     crc32 of the entries (4 bytes)
+ *     INDEX_MAGIC (4 bytes)
+ *
+ * All little endian. The trailer sits at the end of the file, so a reader of
+ * a seekable archive finds the index without reading the blocks, and can
+ * load any block on its own.
+ */
+
+#ifndef ENANO_BLOCK_INDEX_H
+#define ENANO_BLOCK_INDEX_H
+
+#include <stdint.h>
+#include <vector>
+
+class Compressor;
+
+#define INDEX_ENTRY_LEN 32
+#define INDEX_TRAILER_LEN 24
+#define INDEX_MAGIC ".eix"
+
+typedef struct {
+    uint64_t offset;
+    uint32_t comp_len;
+    uint32_t ns;
+    uint64_t first_read;
+    uint64_t uncomp_len;
+} index_entry;
+
+struct block_index {
+    std::vector<index_entry> entries;
+    uint64_t next_offset;   // Where the next block goes
+    uint64_t next_read;     // Ordinal of the first read of the next block
+};
+
+/* Starts an empty index, whose first block goes at offset. */
+void index_start(block_index *idx, uint64_t offset);
+
+/* Adds a block of comp_len bytes, without its length, to the index. */
+void index_add(block_index *idx, uint32_t comp_len, uint32_t ns, uint64_t uncomp_len);
+
+/* Skips bytes of the archive that are not blocks. */
+void index_skip(block_index *idx, uint64_t bytes);
+
+/* Writes the end of blocks mark and the index. Returns 0 on success, -1 on failure. */
+int write_index(int fd, block_index *idx);
+
+/* Reads the index at the end of the archive fd, which must be seekable.
+ * Returns 0 on success, -1 on failure. */
+int read_index(int fd, block_index *idx);
+
+/* Block holding the read of the given ordinal, or the number of blocks if
+ * the archive has fewer reads. */
+uint64_t index_find_read(block_index *idx, uint64_t read);
+
+/* Locates the blocks of the archive fd from its current offset on, whose
+ * first read has the ordinal reads, so they can be loaded with
+ * load_indexed_block(). Reads the index if the archive has one, or else the
+ * length and number of reads at the start of every block, which leaves the
+ * FASTQ lengths unknown. Returns 0 on success, 1 if fd is not a regular file,
+ * -1 on failure. */
+int locate_blocks(int fd, bool indexed, uint64_t reads, block_index *idx);
+
+/* Loads block b of the index into the decode buffer of c with pread(), so
+ * several threads can load blocks at once. Returns false on failure. */
+bool load_indexed_block(int fd, block_index *idx, uint64_t b, Compressor *c);
+
+#endif //ENANO_BLOCK_INDEX_H
@@ -0,0 +1,153 @@
+// MIT License
+
+// Copyright (c) 2020 Guillermo Dufort y Álvarez
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+/*
+ * Heap buffers of the Compressors.
+ *
+ * A GROW_BUF is allocated the first time it is needed and grown to the size
+ * of the data of the block being coded, so a Compressor only holds memory for
+ * the buffers its direction uses. Its storage comes from BUF_POOL, a shared
+ * pool of free buffers, and can be handed back with release() as soon as a
+ * block is done with it. This way buffers only used while coding, like the
+ * compressed streams, are shared by the threads instead of being held by
+ * every Compressor in flight.
+ */
+
+#ifndef ENANO_BUFFERS_H
+#define ENANO_BUFFERS_H
+
+#include <stddef.h>
+#include <string.h>
+#include <mutex>
+#include <vector>
+
+class BUF_POOL {
+public:
+    ~BUF_POOL() {
+        for (size_t i = 0; i < free_bufs.size(); i++)
+            delete [] free_bufs[i].data;
+    }
+
+    /* Returns a buffer of at least size bytes, its capacity is left in cap. */
+    char *get(size_t size, size_t &cap) {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            int best = -1, largest = -1;
+            for (size_t i = 0; i < free_bufs.size(); i++) {
+                size_t c = free_bufs[i].cap;
+                if (c >= size && (best == -1 || c < free_bufs[best].cap))
+                    best = i;
+                if (largest == -1 || c > free_bufs[largest].cap)
+                    largest = i;
+            }
+            /* Reuse the best fit, or drop a buffer that became too small */
+            int pick = (best != -1) ? best : largest;
+            if (pick != -1) {
+                FREE_BUF b = free_bufs[pick];
+                free_bufs[pick] = free_bufs.back();
+                free_bufs.pop_back();
+                if (best != -1) {
+                    cap = b.cap;
+                    return b.data;
+                }
+                delete [] b.data;
+            }
+        }
+        /* Some slack so that blocks of similar size reuse the buffer */
+        cap = size + size / 8;
+        return new char[cap];
+    }
+
+    void put(char *data, size_t cap) {
+        std::lock_guard<std::mutex> lock(m);
+        FREE_BUF b = {data, cap};
+        free_bufs.push_back(b);
+    }
+
+private:
+    struct FREE_BUF {
+        char *data;
+        size_t cap;
+    };
+
+    std::mutex m;
+    std::vector<FREE_BUF> free_bufs;
+};
+
+extern BUF_POOL buf_pool;
+
+template <typename T>
+class GROW_BUF {
+public:
+    GROW_BUF() : data(NULL), cap(0) {}
+
+    ~GROW_BUF() {
+        release();
+    }
+
+    /* Makes room for n elements. The contents are not kept. */
+    T *reserve(size_t n) {
+        if (n > cap) {
+            release();
+            size_t bytes;
+            data = (T *) buf_pool.get((n ? n : 1) * sizeof(T), bytes);
+            cap = bytes / sizeof(T);
+        }
+        return data;
+    }
+
+    /* Makes room for n elements keeping the first used ones. */
+    T *grow(size_t n, size_t used) {
+        if (n > cap) {
+            size_t bytes;
+            T *aux = (T *) buf_pool.get((n > 2 * cap ? n : 2 * cap) * sizeof(T), bytes);
+            if (used)
+                memcpy(aux, data, used * sizeof(T));
+            release();
+            data = aux;
+            cap = bytes / sizeof(T);
+        }
+        return data;
+    }
+
+    /* Hands the storage back to the pool. */
+    void release() {
+        if (data)
+            buf_pool.put((char *) data, cap * sizeof(T));
+        data = NULL;
+        cap = 0;
+    }
+
+    size_t size() const { return cap; }
+
+    operator T *() const { return data; }
+
+private:
+    GROW_BUF(const GROW_BUF &);
+    GROW_BUF &operator=(const GROW_BUF &);
+
+    T *data;
+    size_t cap;
+};
+
+#endif //ENANO_BUFFERS_H
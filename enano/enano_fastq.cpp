@@ -21,7 +21,16 @@
 // SOFTWARE.
 
 #include "Compressor.h"
+#include "fq_input.h"
+#include "pipeline.h"
+#include "model_file.h"
+#include "block_index.h"
 #include <omp.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <thread>
+#include <atomic>
 
 #ifdef __DEBUG_LOG__
 FILE *fp_log_debug = NULL;
@@ -37,7 +46,6 @@ double over_T = 0;
  * Compression functions.
  */
 
-char* in_buf;
 uint AVG_CANT, B_CTX, B_CTX_LEN, NS_MODEL_SIZE;
 
 uint16_t* ctx_avgs_sums;
@@ -47,6 +55,9 @@ uint32_t* ctx_err_avgs_total;
 void init_global_stats(context_models* cm) {
 
     cm->model_seq8 = new BASE_MODEL<uint8_t>[NS_MODEL_SIZE];
+    cm->seq_page_ver = new uint32_t[(NS_MODEL_SIZE >> SEQ_PAGE_SHIFT) + 1];
+    memset(cm->seq_page_ver, 0, ((NS_MODEL_SIZE >> SEQ_PAGE_SHIFT) + 1) * sizeof(uint32_t));
+    cm->seq_epoch = 0;
     ctx_avgs_sums = new uint16_t[AVG_CANT];
     ctx_avgs_err_sums = new uint16_t[AVG_CANT];
     ctx_err_avgs_total = new uint32_t[Q_CTX];
@@ -68,6 +79,7 @@ void init_global_stats(context_models* cm) {
 
 void delete_global_stats(context_models* cm) {
     delete [] cm->model_seq8;
+    delete [] cm->seq_page_ver;
     delete cm;
     delete [] ctx_avgs_sums;
     delete [] ctx_avgs_err_sums;
@@ -81,156 +93,249 @@ void copy_average_stats(Compressor* c) {
 }
 
 /*
- * A blocking read that refuses to return truncated reads.
+ * Slices up to update_load blocks of the input into comps. The blocks are
+ * parsed later by the threads that code them, see parse_block().
  */
-static ssize_t xread(int fd, char *buf, size_t count) {
-    ssize_t len, tlen;
-//    printf("Read %d \n", read_num++);
-    tlen = 0;
-    do {
-        len = read(fd, buf, count);
-        if (len == -1) {
-            if (errno == EINTR)
-                continue;
-            return -1;
-        }
-
-        if (len == 0)
-            return tlen;
-
-        buf += len;
-        count -= len;
-        tlen += len;
-    } while (count);
-
-    return tlen;
-}
+bool load_data(fq_input *in, Compressor ** comps, int update_load, uint &blocks_loaded) {
 
-bool load_data(int in_fd, Compressor ** comps, int update_load, uint &blocks_loaded, int &blk_start) {
-
-    int sz;
-
-    u_char comp_id = 0;
     blocks_loaded = 0;
 
-    while (comp_id < update_load && (sz = xread(in_fd, &in_buf[blk_start], BLK_SIZE - blk_start)) > 0) {
-
-        char *in_end = NULL;
-        int nseqs = 0, remainder_length = 0, end = 0;
-
-        Compressor* c = comps[comp_id];
-
-        int error = 0;
-        if (0 > (error = c->fq_parse_reads(in_buf, sz + blk_start,
-                                    &in_end, &nseqs, &remainder_length, end))) {
-            printf( "Failure to parse and/or compress. Error %d \n", error);
-            return true;
-        }
-        c->total_in += sz;
-
+    while (blocks_loaded < (uint) update_load && next_block(in, comps[blocks_loaded]))
         blocks_loaded++;
-        comp_id++;
 
-        /* We maybe ended on a partial fastq entry, so start from there */
-        if (remainder_length > 0) {
-            memmove(in_buf, in_end, remainder_length);
-            blk_start = remainder_length - 1;
-        } else
-            blk_start = 0;
+    return blocks_loaded <= 0;
+}
+
+/*
+ * Parses the block sliced into c by load_data().
+ * Returns false on failure.
+ */
+static bool parse_block(Compressor *c) {
+    int parsed = c->fq_parse_reads(c->blk_in, c->blk_in_len, c->blk_at_eof);
+    if (parsed < 0) {
+        printf( "Failure to parse and/or compress. Error %d \n", parsed);
+        return false;
     }
+    c->total_in += parsed;
+    c->uncomp_len = parsed;
+    return true;
+}
 
-    return blocks_loaded <= 0;
+/* Writes the block coded by c, and adds it to the index if there is one */
+static bool write_block(Compressor *c, int out_fd, block_index *index) {
+    if (index)
+        index_add(index, c->comp_len, c->ns, c->uncomp_len);
+    return c->output_block(out_fd);
 }
 
-void update_stats(context_models* cm, Compressor** comps, uc blocks_loaded){
+/* The model arrays that field() picks from the models of each block */
+template <class M, class FIELD>
+static M **model_arrays(Compressor **comps, uint blocks, FIELD field) {
+    M **arrays = new M *[blocks];
+    for (uint c = 0; c < blocks; c++)
+        arrays[c] = field(comps[c]->cm);
+    return arrays;
+}
 
-    uint i;
+/*
+ * Mixes the models of the blocks into cm. Every model is averaged in
+ * integers over the blocks on its own, so the models are split among the
+ * threads, the large arrays first.
+ */
+void update_stats(context_models* cm, Compressor** comps, uc blocks_loaded){
 
-    for (i = 0; i < AVG_CANT; i++) {
+    for (uint i = 0; i < AVG_CANT; i++) {
         uint sum_ctx_avgs_sums = 0;
         uint sum_ctx_avgs_err_sums = 0;
         for (uc c = 0; c < blocks_loaded; c++) {
             sum_ctx_avgs_sums += comps[c]->ctx_avgs_sums[i];
             sum_ctx_avgs_err_sums += comps[c]->ctx_avgs_err_sums[i];
         }
-        ctx_avgs_sums[i] = round((double)sum_ctx_avgs_sums/blocks_loaded);
-        ctx_avgs_err_sums[i] = round((double)sum_ctx_avgs_err_sums/blocks_loaded);
+        ctx_avgs_sums[i] = MIX_ROUND(sum_ctx_avgs_sums, blocks_loaded);
+        ctx_avgs_err_sums[i] = MIX_ROUND(sum_ctx_avgs_err_sums, blocks_loaded);
     }
 
-    for (i = 0; i < Q_CTX; i++) {
+    for (uint i = 0; i < Q_CTX; i++) {
         uint sum_ctx_err_avgs_total = 0;
         for (uc c = 0; c < blocks_loaded; c++) {
             sum_ctx_err_avgs_total += comps[c]->ctx_err_avgs_total[i];
         }
-        ctx_err_avgs_total[i] = round((double)sum_ctx_err_avgs_total/blocks_loaded);
+        ctx_err_avgs_total[i] = MIX_ROUND(sum_ctx_err_avgs_total, blocks_loaded);
     }
 
-    void **models = new void *[blocks_loaded];
+    typedef context_models CM;
+    BASE_MODEL<uint8_t> **seq8 = model_arrays<BASE_MODEL<uint8_t> >(comps, blocks_loaded, [](CM *m) { return m->model_seq8; });
+    SIMPLE_MODEL<256> **prefix = model_arrays<SIMPLE_MODEL<256> >(comps, blocks_loaded, [](CM *m) { return m->model_name_prefix; });
+    SIMPLE_MODEL<256> **suffix = model_arrays<SIMPLE_MODEL<256> >(comps, blocks_loaded, [](CM *m) { return m->model_name_suffix; });
+    SIMPLE_MODEL<256> **name_len = model_arrays<SIMPLE_MODEL<256> >(comps, blocks_loaded, [](CM *m) { return m->model_name_len; });
+    SIMPLE_MODEL<128> **middle = model_arrays<SIMPLE_MODEL<128> >(comps, blocks_loaded, [](CM *m) { return m->model_name_middle; });
+    SIMPLE_MODEL<QUANT_D_CANT> **qual = model_arrays<SIMPLE_MODEL<QUANT_D_CANT> >(comps, blocks_loaded, [](CM *m) { return m->model_qual_quant; });
+    SIMPLE_MODEL<QMAX - QUANT_D_CANT> **top = model_arrays<SIMPLE_MODEL<QMAX - QUANT_D_CANT> >(comps, blocks_loaded, [](CM *m) { return &m->quant_top; });
+    SIMPLE_MODEL<256> **len1 = model_arrays<SIMPLE_MODEL<256> >(comps, blocks_loaded, [](CM *m) { return &m->model_len1; });
+    SIMPLE_MODEL<256> **len2 = model_arrays<SIMPLE_MODEL<256> >(comps, blocks_loaded, [](CM *m) { return &m->model_len2; });
+    SIMPLE_MODEL<256> **len3 = model_arrays<SIMPLE_MODEL<256> >(comps, blocks_loaded, [](CM *m) { return &m->model_len3; });
+    SIMPLE_MODEL<2> **same_len = model_arrays<SIMPLE_MODEL<2> >(comps, blocks_loaded, [](CM *m) { return &m->model_same_len; });
+
+    /* The Compressors copied cm before coding, so the sequence model pages
+     * that none of them updated would mix back to the same values */
+    uint pages = (NS_MODEL_SIZE >> SEQ_PAGE_SHIFT) + 1;
+    cm->seq_epoch++;
+
+    #pragma omp parallel
+    {
+        #pragma omp for schedule(dynamic) nowait
+        for (uint pg = 0; pg < pages; pg++) {
+            bool dirty = false;
+            for (uint c = 0; c < blocks_loaded; c++)
+                dirty |= comps[c]->seq_dirty[pg];
+            if (!dirty)
+                continue;
+            cm->seq_page_ver[pg] = cm->seq_epoch;
 
-    for (i = 0; i < NS_MODEL_SIZE; i++) {
-        for (uint c = 0; c < blocks_loaded; c++) {
-            models[c] = (void*)(&comps[c]->cm->model_seq8[i]);
+            uint last = MIN((pg + 1) << SEQ_PAGE_SHIFT, NS_MODEL_SIZE);
+            for (uint i = pg << SEQ_PAGE_SHIFT; i < last; i++)
+                cm->model_seq8[i].mix_array(seq8, i, blocks_loaded);
         }
-        cm->model_seq8[i].mix_array(models, blocks_loaded);
-    }
 
-    for (i = 0; i < 256; i++) {
-        for (uint c = 0; c < blocks_loaded; c++) {
-            models[c] = (void*)(&comps[c]->cm->model_name_prefix[i]);
-        }
-        cm->model_name_prefix[i].mix_array(models, blocks_loaded);
+        #pragma omp for schedule(dynamic, 64) nowait
+        for (uint i = 0; i < CTX_CNT; i++)
+            cm->model_qual_quant[i].mix_array(qual, i, blocks_loaded);
 
-        for (uint c = 0; c < blocks_loaded; c++) {
-            models[c] = (void*)(&comps[c]->cm->model_name_suffix[i]);
-        }
-        cm->model_name_suffix[i].mix_array(models, blocks_loaded);
+        #pragma omp for schedule(dynamic, 64) nowait
+        for (uint i = 0; i < 8192; i++)
+            cm->model_name_middle[i].mix_array(middle, i, blocks_loaded);
 
-        for (uint c = 0; c < blocks_loaded; c++) {
-            models[c] = (void*)(&comps[c]->cm->model_name_len[i]);
+        #pragma omp for schedule(dynamic, 16) nowait
+        for (uint i = 0; i < 256; i++) {
+            cm->model_name_prefix[i].mix_array(prefix, i, blocks_loaded);
+            cm->model_name_suffix[i].mix_array(suffix, i, blocks_loaded);
+            cm->model_name_len[i].mix_array(name_len, i, blocks_loaded);
         }
-        cm->model_name_len[i].mix_array(models, blocks_loaded);
-    }
 
-    for (i = 0; i < 8192; i++) {
-        for (uint c = 0; c < blocks_loaded; c++) {
-            models[c] = (void*)(&comps[c]->cm->model_name_middle[i]);
+        #pragma omp single nowait
+        {
+            cm->quant_top.mix_array(top, 0, blocks_loaded);
+            cm->model_len1.mix_array(len1, 0, blocks_loaded);
+            cm->model_len2.mix_array(len2, 0, blocks_loaded);
+            cm->model_len3.mix_array(len3, 0, blocks_loaded);
+            cm->model_same_len.mix_array(same_len, 0, blocks_loaded);
         }
-        cm->model_name_middle[i].mix_array(models, blocks_loaded);
     }
 
-    for (i = 0; i < CTX_CNT; i++) {
-        for (uint c = 0; c < blocks_loaded; c++) {
-            models[c] = (void*)(&comps[c]->cm->model_qual_quant[i]);
-        }
-        cm->model_qual_quant[i].mix_array(models, blocks_loaded);
-    }
+    delete [] seq8;
+    delete [] prefix;
+    delete [] suffix;
+    delete [] name_len;
+    delete [] middle;
+    delete [] qual;
+    delete [] top;
+    delete [] len1;
+    delete [] len2;
+    delete [] len3;
+    delete [] same_len;
+}
 
-    for (uint c = 0; c < blocks_loaded; c++) {
-        models[c] = (void*)(&comps[c]->cm->quant_top);
-    }
-    cm->quant_top.mix_array(models, blocks_loaded);
+/*
+ * Number of blocks coded in a training batch. The first batch has a single
+ * block, the following ones BLK_UPD_FREQ blocks, until BLK_UPD_THRESH blocks
+ * have been used to train the models.
+ */
+static uint update_batch_size(uint batch, uint update_blocks, uint BLK_UPD_FREQ, uint BLK_UPD_THRESH) {
+    uint batch_size = (batch == 0) ? 1 : BLK_UPD_FREQ;
+    return MIN(BLK_UPD_THRESH - update_blocks, batch_size);
+}
 
-    for (uint c = 0; c < blocks_loaded; c++) {
-        models[c] = (void*)(&comps[c]->cm->model_len1);
+/*
+ * Fast mode encoding once the models are frozen.
+ *
+ * The reader thread loads and parses blocks into free Compressors, the OpenMP
+ * team compresses them as they become available, and the writer thread
+ * outputs them in their original order, so I/O overlaps with the coding.
+ * Every Compressor is owned by a single stage at a time and goes back to the
+ * reader once written. The stage busy times are accumulated in the timers.
+ * The kept_cnt blocks in kept, if any, are coded before those of the input.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int encode_pipeline(fq_input *in, int out_fd, Compressor **comps, uint cant_compressors, uint num_threads,
+                           fq_slice *kept, uint kept_cnt, block_index *index,
+                           uint &block_num, double &load_time, double &code_time, double &write_time) {
+
+    BLOCK_QUEUE<Compressor*> free_q(cant_compressors);
+    BLOCK_QUEUE<Compressor*> work_q(cant_compressors);
+    ORDERED_QUEUE<Compressor*> done_q;
+
+    for (uint i = 0; i < cant_compressors; i++)
+        free_q.push(comps[i]);
+
+    uint64_t blocks_read = 0;
+    std::atomic<bool> failed(false);
+
+    std::thread reader([&]() {
+        Compressor* c;
+        uint blocks_loaded;
+        while (free_q.pop(c)) {
+            double clock = omp_get_wtime();
+            //The kept training blocks go first
+            bool eof = false;
+            if (blocks_read < kept_cnt)
+                restore_block(c, &kept[blocks_read]);
+            else
+                eof = load_data(in, &c, 1, blocks_loaded);
+            load_time += omp_get_wtime() - clock;
+            if (eof)
+                break;
+            c->blk_id = blocks_read++;
+            if (!work_q.push(c))
+                break;
+        }
+        work_q.close();
+    });
+
+    std::thread writer([&]() {
+        Compressor* c;
+        while (done_q.pop(c)) {
+            double clock = omp_get_wtime();
+            if (!failed && !write_block(c, out_fd, index)) {
+                printf( "Abort: truncated write.\n");
+                failed = true;
+                //Stop the reader, the coders drain what is already loaded
+                free_q.close();
+            }
+            write_time += omp_get_wtime() - clock;
+            free_q.push(c);
+        }
+    });
+
+    double clock = omp_get_wtime();
+    #pragma omp parallel num_threads(num_threads)
+    {
+        Compressor* c;
+        while (work_q.pop(c)) {
+            if (parse_block(c)) {
+                c->soft_reset();
+                copy_average_stats(c);
+                c->fq_compress();
+            } else if (!failed.exchange(true)) {
+                free_q.close();
+            }
+            release_block(c);
+            done_q.push(c->blk_id, c);
+        }
     }
-    cm->model_len1.mix_array(models, blocks_loaded);
+    code_time += omp_get_wtime() - clock;
 
-    for (uint c = 0; c < blocks_loaded; c++) {
-        models[c] = (void*)(&comps[c]->cm->model_len2);
-    }
-    cm->model_len2.mix_array(models, blocks_loaded);
+    reader.join();
+    done_q.close();
+    writer.join();
 
-    for (uint c = 0; c < blocks_loaded; c++) {
-        models[c] = (void*)(&comps[c]->cm->model_len3);
-    }
-    cm->model_len3.mix_array(models, blocks_loaded);
+    block_num += blocks_read;
 
-    for (uint c = 0; c < blocks_loaded; c++) {
-        models[c] = (void*)(&comps[c]->cm->model_same_len);
-    }
-    cm->model_same_len.mix_array(models, blocks_loaded);
+    if (in->error)
+        failed = true;
 
-    delete [] models;
+    return failed ? -1 : 0;
 }
 
 /*
@@ -240,13 +345,13 @@ void update_stats(context_models* cm, Compressor** comps, uc blocks_loaded){
  *        -1 on failure
  */
 /*
-* Parse one block at a time. Blocks may not terminate on exact fastq
-* boundaries, so we need to know where we ended processing and move
-* that partial fastq entry back to the start for the next block.
-*
-* We write out the block size too so we can decompress block at a time.
-*/
-int encode(int in_fd, int out_fd, enano_params* p) {
+ * The blocks are slices of the input handed out by fq_input, which ends
+ * them on read boundaries, so each block is parsed in place and holds only
+ * whole reads.
+ *
+ * We write out the block size too so we can decompress block at a time.
+ */
+int encode(fq_input *in, int out_fd, enano_params* p) {
 
     int res = 0;
     bool decode = false;
@@ -255,50 +360,77 @@ int encode(int in_fd, int out_fd, enano_params* p) {
 
     printf("Starting encoding in FAST MODE with %d threads... \n", p->num_threads);
 
-    int blk_start = 0;
     uint block_num = 0;
 
     uint BLK_UPD_FREQ = p->blk_upd_freq;
     uint BLK_UPD_THRESH = p->blk_upd_thresh + 1;
 
-    u_char cant_compressors = MAX(BLK_UPD_FREQ, p->num_threads);
+    uint cant_compressors = MAX(BLK_UPD_FREQ, (uint) (p->num_threads + PIPELINE_EXTRA_BLOCKS));
 
+    //Only the Compressors used for training need models of their own
+    uint train_comps = p->model ? 0 : BLK_UPD_FREQ;
     Compressor** comps = new Compressor*[cant_compressors];
     for (uint i = 0; i < cant_compressors; i ++) {
-        comps[i] = new Compressor(p);
+        comps[i] = new Compressor(p, i < train_comps);
     }
 
-    printf("Starting adaptative encoding for %d (%d + 1) blocks, and update every %d blocks... \n", BLK_UPD_THRESH, BLK_UPD_THRESH - 1, BLK_UPD_FREQ);
-
     bool finished = false;
 
     context_models* cm = new context_models;
     init_global_stats(cm);
 
+    //Pre-trained models skip the training
+    if (p->model) {
+        printf("Starting with the trained models, without training... \n");
+        if (unpack_model(p->model, cm) != 0) {
+            finished = true;
+            res = -1;
+        }
+        BLK_UPD_THRESH = 0;
+    } else {
+        printf("Starting adaptative encoding for %d (%d + 1) blocks, and update every %d blocks... \n", BLK_UPD_THRESH, BLK_UPD_THRESH - 1, BLK_UPD_FREQ);
+    }
+
+    //Input of the training blocks, kept when the archive holds its own models
+    fq_slice *kept = new fq_slice[BLK_UPD_THRESH];
+    uint kept_cnt = 0;
+
     //Update stats
     uint blocks_loaded;
     uint update_blocks = 0;
 
-    uint num_batches = 1 + BLK_UPD_THRESH/BLK_UPD_FREQ;
-    uint* update_batches = new uint[1 + BLK_UPD_THRESH/BLK_UPD_FREQ];
-    update_batches[0] = 1;
-    for (uint i = 1; i < num_batches; i++)
-        update_batches[i] = BLK_UPD_FREQ;
-
     uint batch = 0;
-    uint update_load = update_batches[batch];//MIN(BLK_UPD_FREQ, BLK_UPD_THRESH);
+    uint update_load = update_batch_size(batch, update_blocks, BLK_UPD_FREQ, BLK_UPD_THRESH);
 
-    while (update_blocks < BLK_UPD_THRESH && !(finished = load_data(in_fd, comps, update_load, blocks_loaded, blk_start))) {
-        #pragma omp parallel for
+    while (update_blocks < BLK_UPD_THRESH && !(finished = load_data(in, comps, update_load, blocks_loaded))) {
+        std::atomic<bool> parse_failed(false);
+        #pragma omp parallel for schedule(dynamic)
         for (uint i = 0; i < blocks_loaded; i++) {
-            comps[i]->soft_reset();
-            copy_average_stats(comps[i]);
-            comps[i]->copy_stats(cm);
-            comps[i]->fq_compress();
+            if (parse_block(comps[i])) {
+                comps[i]->soft_reset();
+                copy_average_stats(comps[i]);
+                comps[i]->copy_stats(cm);
+                comps[i]->fq_compress();
+            } else {
+                parse_failed = true;
+            }
+            if (p->embed_model)
+                keep_block(comps[i], &kept[update_blocks + i]);
+            else
+                release_block(comps[i]);
         }
+        if (p->embed_model)
+            kept_cnt += blocks_loaded;
 
-        for (uint i = 0; i < blocks_loaded; i++) {
-            if (!comps[i]->output_block(out_fd)) {
+        if (parse_failed) {
+            finished = true;
+            res = -1;
+            break;
+        }
+
+        //The training blocks of an archive with its own models are coded again with them
+        for (uint i = 0; i < blocks_loaded && !p->embed_model; i++) {
+            if (!write_block(comps[i], out_fd, p->index)) {
                 printf( "Abort: truncated write.\n");
                 finished = true;
                 res = -1;
@@ -308,64 +440,54 @@ int encode(int in_fd, int out_fd, enano_params* p) {
         update_stats(cm, comps, blocks_loaded);
 
         update_blocks += blocks_loaded;
-        block_num += blocks_loaded;
+        if (!p->embed_model)
+            block_num += blocks_loaded;
         batch += 1;
-        update_load = MIN((BLK_UPD_THRESH - update_blocks),  update_batches[batch]);
+        update_load = update_batch_size(batch, update_blocks, BLK_UPD_FREQ, BLK_UPD_THRESH);
     }
 
-    delete [] update_batches;
+    if (p->save_model && res == 0 && save_model(p->save_model, cm, p) != 0) {
+        finished = true;
+        res = -1;
+    }
+
+    //The models go right after the header, and the training output is dropped
+    ssize_t model_len = 0;
+    if (p->embed_model && res == 0) {
+        if ((model_len = write_embedded_model(out_fd, cm, p)) < 0)
+            res = -1;
+        else if (p->index)
+            index_skip(p->index, model_len);
+        for (uint i = 0; i < train_comps; i++)
+            comps[i]->clear_metrics();
+    }
 
     printf("Starting parallelized fast encoding...\n");
     //Update context models accumulated probabilities.
     comps[0]->update_AccFreqs(cm, decode);
     //No updates from now on
-    for (uint i = 0; i < cant_compressors; i++) {
-        comps[i]->updateModel = false;
-        delete [] comps[i]->cm->model_seq8;
-        delete comps[i]->cm;
-        comps[i]->cm = cm;
-    }
+    for (uint i = 0; i < cant_compressors; i++)
+        comps[i]->use_models(cm);
 
     //Finished updating the models
     update_time += omp_get_wtime() - start_time;
 
-    //Parallelized compression with fixed stats
-    double clock = 0;
-    while (!finished) {
-        uint blocks_loaded = 0;
-
-        //Load and parse the data for each compressor
-        clock = omp_get_wtime();
-        finished = load_data(in_fd, comps, p->num_threads, blocks_loaded, blk_start);
-        load_time += omp_get_wtime() - clock;
-        //Encode the loaded data in parallel in each of the threads
-        clock = omp_get_wtime();
-        #pragma omp parallel for
-        for (uint i = 0; i < blocks_loaded; i++) {
-            comps[i]->soft_reset();
-            copy_average_stats(comps[i]);
-            comps[i]->fq_compress();
-        }
-        code_time += omp_get_wtime() - clock;
-        //Write the data to the file in order
-        clock = omp_get_wtime();
-        for (uint i = 0; i < blocks_loaded; i++) {
-            if (!comps[i]->output_block(out_fd)) {
-                printf( "Abort: truncated write.\n");
-                finished = true;
-                res = -1;
-                break;
-            }
-        }
-        write_time += omp_get_wtime() - clock;
-        block_num += blocks_loaded;
-    }
+    //Parallelized compression with fixed stats, pipelined with the I/O
+    if ((!finished || kept_cnt > 0) && res == 0)
+        res = encode_pipeline(in, out_fd, comps, cant_compressors, p->num_threads, kept, kept_cnt, p->index,
+                              block_num, load_time, code_time, write_time);
+    for (uint i = 0; i < kept_cnt; i++)
+        release_slice(&kept[i]);
+    delete [] kept;
+
+    if (in->error)
+        res = -1;
 
     printf("Total encoded blocks: %d \n", block_num);
 
     long long name_in = 0, name_out = 0, base_in = 0, base_out = 0, qual_in = 0, qual_out = 0;
     //We initialize total_out in 9 for the 9 bytes of the header
-    long long total_in = 0, total_out = 9;
+    long long total_in = 0, total_out = 9 + model_len;
     for (uint i = 0; i < cant_compressors; i++) {
         name_in += comps[i]->name_in;
         name_out += comps[i]->name_out;
@@ -419,7 +541,28 @@ int encode(int in_fd, int out_fd, enano_params* p) {
 }
 
 
-int encode_st(int in_fd, int out_fd, enano_params* p) {
+/*
+ * Mixes the models of the max compression streams, and every stream carries
+ * on coding from the mix.
+ */
+static void sync_streams(context_models *cm, Compressor **comps, uint streams) {
+    update_stats(cm, comps, streams);
+    #pragma omp parallel for
+    for (uint i = 0; i < streams; i++) {
+        comps[i]->copy_stats(cm);
+        copy_average_stats(comps[i]);
+    }
+}
+
+/*
+ * Max compression mode, the models adapt all along the file.
+ *
+ * The blocks are coded in p->mc_streams streams, block i by the Compressor of
+ * stream i % mc_streams, so each round of mc_streams blocks is coded in
+ * parallel. Every p->mc_sync rounds the models of the streams are mixed,
+ * like in the training of fast mode. A single stream is never mixed.
+ */
+int encode_st(fq_input *in, int out_fd, enano_params* p) {
 
     int res = 0;
     double start_time = omp_get_wtime();
@@ -429,46 +572,81 @@ int encode_st(int in_fd, int out_fd, enano_params* p) {
     double code_time = 0, load_time = 0, write_time = 0, update_time = 0;
 #endif
 
-    printf("Starting encoding in Max Compression mode... \n");
+    printf("Starting encoding in Max Compression mode with %d streams... \n", p->mc_streams);
 
-    int blk_start = 0;
     uint block_num = 0;
 
-    uint cant_compressors = 1;
+    uint cant_compressors = p->mc_streams;
 
     Compressor** comps = new Compressor*[cant_compressors];
-    comps[0] = new Compressor(p);
+    for (uint i = 0; i < cant_compressors; i++)
+        comps[i] = new Compressor(p);
+
+    context_models* cm = NULL;
+    if (cant_compressors > 1) {
+        cm = new context_models;
+        init_global_stats(cm);
+    }
 
     //Update stats
     uint blocks_loaded;
-    while (!load_data(in_fd, comps, 1,blocks_loaded,blk_start)) {
-        comps[0]->fq_compress();
-        if (!comps[0]->output_block(out_fd)) {
-            printf( "Abort: truncated write.\n");
+    uint round = 0;
+    while (!load_data(in, comps, cant_compressors, blocks_loaded)) {
+        std::atomic<bool> parse_failed(false);
+        #pragma omp parallel for num_threads(p->num_threads) schedule(dynamic)
+        for (uint i = 0; i < blocks_loaded; i++) {
+            if (parse_block(comps[i]))
+                comps[i]->fq_compress();
+            else
+                parse_failed = true;
+            release_block(comps[i]);
+        }
+        if (parse_failed) {
             res = -1;
             break;
         }
+        for (uint i = 0; i < blocks_loaded && res == 0; i++) {
+            if (!write_block(comps[i], out_fd, p->index)) {
+                printf( "Abort: truncated write.\n");
+                res = -1;
+            }
+        }
+        if (res != 0)
+            break;
         block_num += blocks_loaded;
+
+        if (cant_compressors > 1 && ++round % p->mc_sync == 0)
+            sync_streams(cm, comps, cant_compressors);
     }
 
+    if (in->error)
+        res = -1;
+
     printf("Total encoded blocks: %d \n", block_num);
 
     long long name_in = 0, name_out = 0, base_in = 0, base_out = 0, qual_in = 0, qual_out = 0;
     //We initialize total_out in 9 for the 9 bytes of the header
     long long total_in = 0, total_out = 9;
 
-    name_in += comps[0]->name_in;
-    name_out += comps[0]->name_out;
-    base_in += comps[0]->base_in;
-    base_out += comps[0]->base_out;
-    qual_in += comps[0]->qual_in;
-    qual_out += comps[0]->qual_out;
-    total_in += comps[0]->total_in;
-    total_out += comps[0]->total_out;
-
+    for (uint i = 0; i < cant_compressors; i++) {
+        name_in += comps[i]->name_in;
+        name_out += comps[i]->name_out;
+        base_in += comps[i]->base_in;
+        base_out += comps[i]->base_out;
+        qual_in += comps[i]->qual_in;
+        qual_out += comps[i]->qual_out;
+        total_in += comps[i]->total_in;
+        total_out += comps[i]->total_out;
+    }
 
-    delete comps[0];
+    for (uint i = 0; i < cant_compressors; i++) {
+        delete [] comps[i]->cm->model_seq8;
+        delete comps[i]->cm;
+        delete comps[i];
+    }
     delete [] comps;
+    if (cm)
+        delete_global_stats(cm);
 
     enc_time = omp_get_wtime() - start_time;
 
@@ -504,7 +682,10 @@ int encode_st(int in_fd, int out_fd, enano_params* p) {
     return res;
 }
 
-bool load_data_decode(int in_fd, Compressor ** comps, int update_load, uint &blocks_loaded) {
+//Set once the end of blocks mark of an archive with an index is read, what follows is the index
+static bool blocks_end = false;
+
+bool load_data_decode(int in_fd, Compressor ** comps, int update_load, uint &blocks_loaded, bool &read_error) {
 
     int res = 0;
     unsigned char len_buf[4];
@@ -514,63 +695,225 @@ bool load_data_decode(int in_fd, Compressor ** comps, int update_load, uint &blo
 
     u_char comp_id = 0;
 
-    while ( comp_id < update_load && (4 == (sz = read(in_fd, len_buf, 4))) ) {
+    while (comp_id < update_load && !blocks_end && (sz = xread(in_fd, (char *) len_buf, 4)) != 0) {
+        if (sz != 4) {
+            printf( "Abort: truncated read, %d.\n", errno);
+            res = -1;
+            goto error;
+        }
+
         int32_t comp_len =
                 (len_buf[0] << 0) +
                 (len_buf[1] << 8) +
                 (len_buf[2] << 16) +
                 (len_buf[3] << 24);
 
-        int rem_len = comp_len, in_off = 0;
-
-        do {
-            errno = 0;
-            int tmp_len = read(in_fd, comps[comp_id]->decode_buf + in_off, rem_len);
-            if (errno == EINTR && tmp_len == -1)
-                continue;
+        if (comp_len < 0) {
+            printf( "Abort: corrupt block length %d.\n", comp_len);
+            res = -1;
+            goto error;
+        }
+        if (comp_len == 0) {
+            blocks_end = true;
+            break;
+        }
 
-            if (tmp_len == -1) {
-                printf( "Abort: read failed, %d.\n", errno);
-                perror("foo");
-                res = -1;
-                goto error;
-            }
-            if (tmp_len == 0) {
-                printf( "Abort: truncated read, %d.\n", errno);
-                res = -1;
-                goto error;
-            }
-            rem_len -= tmp_len;
-            in_off += tmp_len;
-        } while (rem_len);
+        sz = xread(in_fd, comps[comp_id]->decode_buf.reserve(comp_len), comp_len);
+        if (sz == -1) {
+            printf( "Abort: read failed, %d.\n", errno);
+            res = -1;
+            goto error;
+        }
+        if (sz != comp_len) {
+            printf( "Abort: truncated read.\n");
+            res = -1;
+            goto error;
+        }
 
         blocks_loaded++;
         comp_id++;
     }
     error:
+    read_error = (res == -1);
     return (blocks_loaded <= 0) || (res == -1);
 }
 
 /*
- * Decode an entire stream
+ * Fast mode decoding once the models are frozen.
+ *
+ * Same structure as encode_pipeline(): the reader thread prefetches the
+ * compressed blocks, the OpenMP team decodes them, and the writer thread
+ * outputs the FASTQ text in block order.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int decode_pipeline(int in_fd, int out_fd, Compressor **comps, uint cant_compressors, uint num_threads,
+                           uint &block_num, double &load_time, double &decode_time, double &write_time) {
+
+    BLOCK_QUEUE<Compressor*> free_q(cant_compressors);
+    BLOCK_QUEUE<Compressor*> work_q(cant_compressors);
+    ORDERED_QUEUE<Compressor*> done_q;
+
+    for (uint i = 0; i < cant_compressors; i++)
+        free_q.push(comps[i]);
+
+    uint64_t blocks_read = 0;
+    std::atomic<bool> failed(false);
+
+    std::thread reader([&]() {
+        Compressor* c;
+        uint blocks_loaded;
+        bool read_error = false;
+        while (free_q.pop(c)) {
+            double clock = omp_get_wtime();
+            bool eof = load_data_decode(in_fd, &c, 1, blocks_loaded, read_error);
+            load_time += omp_get_wtime() - clock;
+            if (eof)
+                break;
+            c->blk_id = blocks_read++;
+            if (!work_q.push(c))
+                break;
+        }
+        if (read_error)
+            failed = true;
+        work_q.close();
+    });
+
+    std::thread writer([&]() {
+        Compressor* c;
+        while (done_q.pop(c)) {
+            double clock = omp_get_wtime();
+            if (!failed && !c->write_output(out_fd)) {
+                printf( "Abort: truncated write.\n");
+                failed = true;
+                //Stop the reader, the decoders drain what is already loaded
+                free_q.close();
+            }
+            write_time += omp_get_wtime() - clock;
+            free_q.push(c);
+        }
+    });
+
+    double clock = omp_get_wtime();
+    #pragma omp parallel num_threads(num_threads)
+    {
+        Compressor* c;
+        while (work_q.pop(c)) {
+            c->soft_reset();
+            copy_average_stats(c);
+            c->fq_decompress();
+            done_q.push(c->blk_id, c);
+        }
+    }
+    decode_time += omp_get_wtime() - clock;
+
+    reader.join();
+    done_q.close();
+    writer.join();
+
+    block_num += blocks_read;
+
+    return failed ? -1 : 0;
+}
+
+/*
+ * Fast mode decoding of a seekable archive once the models are frozen.
+ *
+ * The decoder threads take free Compressors, claim the next of the blocks
+ * [first_block, last_block) located in blocks, and load it with pread() on
+ * their own, so the archive is read by all of them at once instead of
+ * through a single reader. The writer thread outputs the reads of the -x
+ * range in block order, as in decode_pipeline(). The load time is summed
+ * over the threads.
  *
  * Returns 0 on success
  *        -1 on failure
  */
+static int decode_blocks(int in_fd, int out_fd, Compressor **comps, uint cant_compressors, enano_params *p,
+                         block_index *blocks, uint64_t first_block, uint64_t last_block,
+                         uint &block_num, double &load_time, double &decode_time, double &write_time) {
+
+    BLOCK_QUEUE<Compressor*> free_q(cant_compressors);
+    ORDERED_QUEUE<Compressor*> done_q;
+
+    for (uint i = 0; i < cant_compressors; i++)
+        free_q.push(comps[i]);
+
+    std::atomic<uint64_t> next_block(first_block);
+    std::atomic<bool> failed(false);
+
+    std::thread writer([&]() {
+        Compressor* c;
+        while (done_q.pop(c)) {
+            double clock = omp_get_wtime();
+            if (!failed && !c->write_output(out_fd)) {
+                printf( "Abort: truncated write.\n");
+                failed = true;
+                //Stop the decoders, those already loaded are drained
+                free_q.close();
+            }
+            write_time += omp_get_wtime() - clock;
+            free_q.push(c);
+        }
+    });
+
+    double clock = omp_get_wtime();
+    #pragma omp parallel num_threads(p->num_threads)
+    {
+        Compressor* c;
+        double thread_load_time = 0;
+        //The block is claimed once there is a Compressor for it, so the writer never waits on a block without one
+        while (free_q.pop(c)) {
+            uint64_t b = next_block++;
+            if (b >= last_block) {
+                free_q.push(c);
+                break;
+            }
+            double load_clock = omp_get_wtime();
+            bool loaded = load_indexed_block(in_fd, blocks, b, c);
+            thread_load_time += omp_get_wtime() - load_clock;
+            if (loaded) {
+                c->soft_reset();
+                copy_average_stats(c);
+                c->first_read = blocks->entries[b].first_read;
+                c->fq_decompress();
+            } else if (!failed.exchange(true)) {
+                free_q.close();
+            }
+            c->blk_id = b;
+            done_q.push(b - first_block, c);
+        }
+        #pragma omp atomic
+        load_time += thread_load_time;
+    }
+    decode_time += omp_get_wtime() - clock;
+
+    done_q.close();
+    writer.join();
+
+    block_num += MIN(next_block.load(), last_block) - first_block;
+
+    return failed ? -1 : 0;
+}
 
 /*
- * Parse one block at a time. Blocks may not terminate on exact fastq
- * boundaries, so we need to know where we ended processing and move
- * that partial fastq entry back to the start for the next block.
+ * Decode an entire stream
  *
- * We write out the block size too so we can decompress block at a time.
+ * Returns 0 on success
+ *        -1 on failure
+ */
+
+/*
+ * Every block is preceded by its compressed size and decodes to whole
+ * reads. The training blocks are decoded in batches to rebuild the models,
+ * then the rest are decoded in parallel with the models frozen.
  */
 int decode(int in_fd, int out_fd, enano_params* p) {
     int res = 0;
     bool decode = true;
     double start_time = omp_get_wtime();
     double dec_time = 0, decode_time = 0, load_time = 0, write_time = 0, update_time = 0;
-    double clock = 0;
 
     printf("Starting decoding with %d threads... \n", p->num_threads);
 
@@ -579,36 +922,50 @@ int decode(int in_fd, int out_fd, enano_params* p) {
     uint BLK_UPD_FREQ = p->blk_upd_freq;
     uint BLK_UPD_THRESH = p->blk_upd_thresh + 1;
 
-    u_char cant_compressors = MAX(BLK_UPD_FREQ, p->num_threads);
+    uint cant_compressors = MAX(BLK_UPD_FREQ, (uint) (p->num_threads + PIPELINE_EXTRA_BLOCKS));
 
+    //Only the Compressors used for training need models of their own
+    uint train_comps = p->model ? 0 : BLK_UPD_FREQ;
     Compressor** comps = new Compressor*[cant_compressors];
     for (uint i = 0; i < cant_compressors; i ++) {
-        comps[i] = new Compressor(p);
-        comps[i]->decode_buf = new char[BLK_SIZE];
+        comps[i] = new Compressor(p, i < train_comps);
     }
 
-    printf("Starting decoding with context model update... \n");
-
     bool finished = false;
 
     context_models* cm = new context_models;
     init_global_stats(cm);
 
+    //Pre-trained models skip the training
+    if (p->model) {
+        printf("Starting with the trained models, without training... \n");
+        if (unpack_model(p->model, cm) != 0) {
+            finished = true;
+            res = -1;
+        }
+        BLK_UPD_THRESH = 0;
+    } else {
+        printf("Starting decoding with context model update... \n");
+    }
+
     //Update stats
     uint blocks_loaded;
     uint update_blocks = 0;
-    uint num_batches = 1 + BLK_UPD_THRESH/BLK_UPD_FREQ;
-    uint* update_batches = new uint[1 + BLK_UPD_THRESH/BLK_UPD_FREQ];
-    update_batches[0] = 1;
-    for (uint i = 1; i < num_batches; i++)
-        update_batches[i] = BLK_UPD_FREQ;
 
     uint batch = 0;
-    uint update_load = update_batches[batch];
+    uint update_load = update_batch_size(batch, update_blocks, BLK_UPD_FREQ, BLK_UPD_THRESH);
+    bool read_error = false;
+    //Ordinal of the first read of the next block
+    uint64_t reads = 0;
 
-    while (update_blocks < BLK_UPD_THRESH && !(finished = load_data_decode(in_fd, comps, update_load, blocks_loaded))) {
+    while (update_blocks < BLK_UPD_THRESH && !(finished = load_data_decode(in_fd, comps, update_load, blocks_loaded, read_error))) {
 
-#pragma omp parallel for
+        //The blocks start with their number of reads, so they are placed in the -x range before decoding
+        for (uint i = 0; i < blocks_loaded; i++) {
+            comps[i]->first_read = reads;
+            reads += DECODE_INT((unsigned char *) (char *) comps[i]->decode_buf);
+        }
+#pragma omp parallel for schedule(dynamic)
         for (uint i = 0; i < blocks_loaded; i++) {
             comps[i]->soft_reset();
             copy_average_stats(comps[i]);
@@ -617,7 +974,7 @@ int decode(int in_fd, int out_fd, enano_params* p) {
         }
         //Write output
         for (uint i = 0; i < blocks_loaded; i++) {
-            if (comps[i]->uncomp_len != write(out_fd, comps[i]->out_buf, comps[i]->uncomp_len)) {
+            if (!comps[i]->write_output(out_fd)) {
                 printf( "Abort: truncated write.\n");
                 res = -1;
                 goto finishdecode;
@@ -628,10 +985,17 @@ int decode(int in_fd, int out_fd, enano_params* p) {
         update_blocks += blocks_loaded;
         block_num += blocks_loaded;
         batch += 1;
-        update_load = MIN((BLK_UPD_THRESH - update_blocks),  update_batches[batch]);
+        update_load = update_batch_size(batch, update_blocks, BLK_UPD_FREQ, BLK_UPD_THRESH);
+
+        //The -x range ends in the training blocks
+        if (p->extract_last && reads >= p->extract_last) {
+            finished = true;
+            break;
+        }
     }
 
-    delete [] update_batches;
+    if (read_error)
+        res = -1;
 
     if (!finished) {
 
@@ -640,46 +1004,43 @@ int decode(int in_fd, int out_fd, enano_params* p) {
         //Update context models accumulated probabilities.
         comps[0]->update_AccFreqs(cm, decode);
         //No updates from now on
-        for (uint i = 0; i < cant_compressors; i++) {
-            comps[i]->updateModel = false;
-            delete comps[i]->cm;
-            comps[i]->cm = cm;
-        }
+        for (uint i = 0; i < cant_compressors; i++)
+            comps[i]->use_models(cm);
 
         //Finished updating the models
         update_time += omp_get_wtime() - start_time;
 
-        //Parallelized decompression with fixed stats
-        while (!finished) {
-
-            uint blocks_loaded = 0;
-
-            clock = omp_get_wtime();
-            finished = load_data_decode(in_fd, comps, p->num_threads, blocks_loaded);
-            load_time += omp_get_wtime() - clock;
-
-            clock = omp_get_wtime();
-            #pragma omp parallel for
-            for (uint i = 0; i < blocks_loaded; i ++) {
-                comps[i]->soft_reset();
-                copy_average_stats(comps[i]);
-                comps[i]->fq_decompress();
-            }
-            decode_time += omp_get_wtime() - clock;
-
-            clock = omp_get_wtime();
-            for (uint i = 0; i < blocks_loaded; i ++) {
-                if (comps[i]->uncomp_len != write(out_fd, comps[i]->out_buf, comps[i]->uncomp_len)) {
-                    printf( "Abort: truncated write.\n");
-                    res = -1;
-                    goto finishdecode;
-                }
+        //Parallelized decompression with fixed stats, pipelined with the I/O.
+        //The decoder threads load the blocks of a regular file themselves.
+        block_index scanned;
+        block_index *blocks = p->index ? p->index : &scanned;
+        int located = locate_blocks(in_fd, p->index != NULL, reads, blocks);
+        if (located == 0 && p->extract_last > blocks->next_read) {
+            //The -x range runs past the last read, reported below without decoding any of it
+            reads = blocks->next_read;
+        } else if (located == 0) {
+            uint64_t first_block = 0, last_block = blocks->entries.size();
+            //Only the blocks holding the -x range are decoded
+            if (p->extract_last) {
+                first_block = index_find_read(blocks, p->extract_first);
+                last_block = MIN(index_find_read(blocks, p->extract_last - 1) + 1, last_block);
             }
-            write_time += omp_get_wtime() - clock;
-
-            block_num += blocks_loaded;
+            res = decode_blocks(in_fd, out_fd, comps, cant_compressors, p,
+                                blocks, first_block, last_block, block_num, load_time, decode_time, write_time);
+            reads = blocks->next_read;
+        } else if (located == 1 && !p->extract_last) {
+            res = decode_pipeline(in_fd, out_fd, comps, cant_compressors, p->num_threads,
+                                  block_num, load_time, decode_time, write_time);
+        } else {
+            res = -1;
         }
     }
+
+    if (res == 0 && p->extract_last && reads < p->extract_last) {
+        printf( "Abort: the archive has only %lu reads.\n", (unsigned long) reads);
+        res = -1;
+    }
+
     //We use this goto flag to break the double loop
     finishdecode:
 
@@ -701,7 +1062,6 @@ int decode(int in_fd, int out_fd, enano_params* p) {
             (double)dec_time);
 
     for (uint i = 0; i < cant_compressors; i ++) {
-        delete comps[i]->decode_buf;
         if (comps[i]->cm != cm)
             delete comps[i]->cm;
         delete comps[i];
@@ -720,32 +1080,56 @@ int decode_st (int in_fd, int out_fd, enano_params* p) {
 #ifdef __TIMING__
     decode_time = 0, load_time = 0, write_time = 0, update_time = 0;
 #endif
-    printf("Starting decoding Max Compression mode... \n");
+    printf("Starting decoding Max Compression mode with %d streams... \n", p->mc_streams);
 
     uint block_num = 0;
 
-    u_char cant_compressors = 1;
+    uint cant_compressors = p->mc_streams;
 
     Compressor** comps = new Compressor*[cant_compressors];
-    comps[0] = new Compressor(p);
-    comps[0]->decode_buf = new char[BLK_SIZE];
+    for (uint i = 0; i < cant_compressors; i++)
+        comps[i] = new Compressor(p);
 
-    //Update stats
+    context_models* cm = NULL;
+    if (cant_compressors > 1) {
+        cm = new context_models;
+        init_global_stats(cm);
+    }
+
+    //Same streams and mixes as encode_st()
     uint blocks_loaded;
-    while (!load_data_decode(in_fd, comps, 1, blocks_loaded)) {
-        comps[0]->fq_decompress();
+    uint round = 0;
+    bool read_error = false;
+    while (!load_data_decode(in_fd, comps, cant_compressors, blocks_loaded, read_error)) {
+        #pragma omp parallel for num_threads(p->num_threads) schedule(dynamic)
+        for (uint i = 0; i < blocks_loaded; i++)
+            comps[i]->fq_decompress();
         //Write output
-        if (comps[0]->uncomp_len != write(out_fd, comps[0]->out_buf, comps[0]->uncomp_len)) {
-            printf( "Abort: truncated write.\n");
-            res = -1;
-            break;
+        for (uint i = 0; i < blocks_loaded && res == 0; i++) {
+            if (!comps[i]->write_output(out_fd)) {
+                printf( "Abort: truncated write.\n");
+                res = -1;
+            }
         }
+        if (res != 0)
+            break;
         block_num += blocks_loaded;
+
+        if (cant_compressors > 1 && ++round % p->mc_sync == 0)
+            sync_streams(cm, comps, cant_compressors);
     }
 
-    delete comps[0]->decode_buf;
-    delete comps[0];
+    if (read_error)
+        res = -1;
+
+    for (uint i = 0; i < cant_compressors; i++) {
+        delete [] comps[i]->cm->model_seq8;
+        delete comps[i]->cm;
+        delete comps[i];
+    }
     delete [] comps;
+    if (cm)
+        delete_global_stats(cm);
 
     dec_time = omp_get_wtime() - start_time;
 
@@ -778,14 +1162,37 @@ static void usage(int err) {
     printf( "are the ones proposed by James Bonefield in FQZComp, with some modifications.\n");
     printf( "The range coder is derived from Eugene Shelwien.\n\n");
 
-    printf( "To compress:\n  enano [options] [input_file [output_file]]\n\n");
+    printf( "To compress:\n  enano [options] input_file [output_file]\n\n");
     printf( "    -c             To use MAX COMPRESION MODE. Default is FAST MODE.\n\n");
-    printf( "    -k <length>    Base sequence context length. Default is 7 (max 13).\n\n");
+    printf( "    -p <streams>   Code MAX COMPRESION MODE in up to 64 parallel streams of blocks, which\n");
+    printf( "                   share their models every %d rounds. Faster, for a small loss. Default is 1.\n\n",
+            DEFAULT_MC_SYNC_ROUNDS);
+    printf( "    -k <length>    Base sequence context length. Default is 7 (max 13, or 15 with -a).\n\n");
+    printf( "    -a             Use 2 bit ACGT sequence contexts, N is taken as A in the context.\n");
+    printf( "                   Needs 4^k instead of 5^k sequence models, for large -k.\n\n");
     printf( "    -l <lenght>    Length of the DNA sequence context. Default is 6.\n\n");
     printf( "    -t <num>       Maximum number of threads allowed to use by the compressor. Default is 8.\n\n");
-
-    printf( "To decompress:\n   enano -d [options] foo.enano foo.fastq\n");
+    printf( "    -L <lanes>     Code the bases in up to 16 interleaved lanes of reads. Faster on large\n");
+    printf( "                   sequence models (large -k), at a small cost in size. Default is 1.\n\n");
+    printf( "    -s <size>      Block size in bytes, K and M suffixes allowed. Default is 10M.\n");
+    printf( "                   Reads longer than a block get a block of their own.\n\n");
+    printf( "    -r             Code the blocks after training with static rANS instead of the range\n");
+    printf( "                   coder, for faster decompression. Fast mode only.\n\n");
+    printf( "    --save-model <file>  Save the models trained on the first blocks to file. Fast mode only.\n\n");
+    printf( "    --model <file> Start from the models of a model file instead of training, so every\n");
+    printf( "                   block is coded in parallel. Its k, l and -a levels are used. Fast mode only.\n\n");
+    printf( "    --embed-model  Save the trained models in the archive and code every block with them,\n");
+    printf( "                   so all the blocks decode in parallel and on their own. Fast mode only.\n\n");
+    printf( "    --index        End the archive with an index of its blocks, to reach any block directly.\n\n");
+
+    printf( "To decompress:\n   enano -d [options] foo.enano [foo.fastq]\n");
     printf( "    -t <num>       Maximum number of threads allowed to use by the decompressor. Default is 8.\n\n");
+    printf( "    --model <file> The model file the archive was coded with, if any.\n\n");
+    printf( "    -x <first>-<last>  Decode only the reads first to last, counted from 1. After the\n");
+    printf( "                   training blocks, only the blocks holding them are decoded. Fast mode only.\n\n");
+
+    printf( "Use - as file name to read from stdin or write to stdout, e.g. enano -d - - | ...\n");
+    printf( "Progress messages go to stderr when writing to stdout.\n\n");
 
     exit(err);
 }
@@ -805,9 +1212,50 @@ int main (int argc, char **argv) {
     p.blk_upd_freq = DEFAULT_BLK_UPD_FREQ;
     p.blk_upd_thresh = DEFAULT_BLK_UPD_THRESH;
     p.max_comp = false;
-
-    while ((opt = getopt(argc, argv, "hdk:l:t:cb:")) != -1) {
+    p.blk_size = DEFAULT_BLK_SIZE;
+    p.seq_ctx2 = false;
+    p.seq_lanes = 1;
+    p.rans = false;
+    p.mc_streams = 1;
+    p.mc_sync = DEFAULT_MC_SYNC_ROUNDS;
+    p.save_model = NULL;
+    p.model = NULL;
+    p.embed_model = false;
+    p.index = NULL;
+    p.extract_first = 0;
+    p.extract_last = 0;
+    bool want_index = false;
+    block_index index;
+    const char *model_path = NULL;
+    model_file model;
+
+    enum { OPT_SAVE_MODEL = 256, OPT_MODEL, OPT_EMBED_MODEL, OPT_INDEX };
+    static struct option long_opts[] = {
+            {"save-model", required_argument, NULL, OPT_SAVE_MODEL},
+            {"model", required_argument, NULL, OPT_MODEL},
+            {"embed-model", no_argument, NULL, OPT_EMBED_MODEL},
+            {"index", no_argument, NULL, OPT_INDEX},
+            {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "hdk:l:t:cb:s:aL:rp:x:", long_opts, NULL)) != -1) {
         switch (opt) {
+            case OPT_SAVE_MODEL:
+                p.save_model = optarg;
+                break;
+
+            case OPT_MODEL:
+                model_path = optarg;
+                break;
+
+            case OPT_EMBED_MODEL:
+                p.embed_model = true;
+                break;
+
+            case OPT_INDEX:
+                want_index = true;
+                break;
+
             case 'h':
                 usage(0);
                 break;
@@ -815,14 +1263,51 @@ int main (int argc, char **argv) {
                 decompress = 1;
                 break;
 
+            /* Reads first-last, counted from 1, or a single read */
+            case 'x': {
+                char *end;
+                uint64_t first = strtoull(optarg, &end, 10);
+                uint64_t last = first;
+                if (*end == '-')
+                    last = strtoull(end + 1, &end, 10);
+                if (*end != '\0' || first < 1 || last < first || last == UINT64_MAX)
+                    usage(1);
+                p.extract_first = first - 1;
+                p.extract_last = last;
+                decompress = 1;
+                break;
+            }
+
             case 'k': {
                 char *end;
                 p.klevel = strtol(optarg, &end, 10);
-                if (p.klevel > 13)
+                if (p.klevel < 1 || p.klevel > MAX_K_LEVEL_CTX2)
                     usage(1);
                 break;
             }
 
+            case 'a':
+                p.seq_ctx2 = true;
+                break;
+
+            case 'L':
+                p.seq_lanes = atoi(optarg);
+                if (p.seq_lanes < 1 || p.seq_lanes > MAX_SEQ_LANES)
+                    usage(1);
+                break;
+
+            case 'r':
+                p.rans = true;
+                break;
+
+            case 'p': {
+                int streams = atoi(optarg);
+                if (streams < 1 || streams > MAX_MC_STREAMS)
+                    usage(1);
+                p.mc_streams = streams;
+                break;
+            }
+
             case 'l':
                 p.llevel = atoi(optarg);
                 break;
@@ -839,24 +1324,58 @@ int main (int argc, char **argv) {
                 p.max_comp = true;
                 break;
 
+            case 's': {
+                char *end;
+                uint64_t size = strtoull(optarg, &end, 10);
+                if (!isdigit((unsigned char) optarg[0]) || size > MAX_BLK_SIZE)
+                    usage(1);
+                if (*end == 'k' || *end == 'K')
+                    size *= 1000, end++;
+                else if (*end == 'm' || *end == 'M')
+                    size *= 1000000, end++;
+                if (*end != '\0' || size < MIN_BLK_SIZE || size > MAX_BLK_SIZE)
+                    usage(1);
+                p.blk_size = (uint32_t) size;
+                break;
+            }
+
             default:
                 usage(1);
         }
     }
 
-    if (argc - optind > 2 || argc <= 2 || (decompress == 1 && argc <= 3))
+    if (!decompress && p.klevel > (p.seq_ctx2 ? MAX_K_LEVEL_CTX2 : MAX_K_LEVEL))
+        usage(1);
+
+    /* Only fast mode trains its models */
+    if ((p.save_model || model_path || p.embed_model) && p.max_comp) {
+        printf( "Abort: --save-model, --model and --embed-model are for fast mode only.\n");
+        return 1;
+    }
+    if ((p.save_model || p.embed_model || want_index) && decompress)
+        usage(1);
+
+    /* A missing file name or "-" means stdin or stdout */
+    if (argc - optind > 2 || argc == optind)
         usage(1);
 
     if (optind != argc) {
         int open_flag = O_RDONLY;
-        if ((in_fd = open(argv[optind], open_flag)) == -1) {
+        if (strcmp(argv[optind], "-") != 0 && (in_fd = open(argv[optind], open_flag)) == -1) {
             perror(argv[optind]);
             exit(1);
         }
         optind++;
     }
 
-    if (optind != argc) {
+    /* The blocks of the -x range are loaded on their own */
+    struct stat in_st;
+    if (p.extract_last && (fstat(in_fd, &in_st) == -1 || !S_ISREG(in_st.st_mode))) {
+        printf( "Abort: reads can only be extracted from an archive file, not a pipe.\n");
+        return 1;
+    }
+
+    if (optind != argc && strcmp(argv[optind], "-") != 0) {
         out_fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0666);
         if (out_fd == -1) {
             perror(argv[optind]);
@@ -865,7 +1384,13 @@ int main (int argc, char **argv) {
         optind++;
     }
 
-    in_buf = new char[BLK_SIZE];
+    /* The data goes to stdout, so keep a descriptor to it and send the
+     * progress messages to stderr */
+    if (out_fd == 1) {
+        out_fd = dup(1);
+        dup2(2, 1);
+    }
+
     omp_set_num_threads(p.num_threads);
 
     if (decompress) {
@@ -875,7 +1400,7 @@ int main (int argc, char **argv) {
         unsigned char magic[9];
 
         /* Check magic number */
-        if (9 != read(in_fd, magic, 9)) {
+        if (9 != xread(in_fd, (char *) magic, 9)) {
             printf( "Abort: truncated read.\n");
             return 1;
         }
@@ -889,8 +1414,9 @@ int main (int argc, char **argv) {
             return 1;
         }
 
+        p.seq_ctx2 = magic[7] & HDR_SEQ_CTX2;
         p.klevel = magic[5] & 0x0f;
-        if (p.klevel > 13 || p.klevel < 1) {
+        if (p.klevel > (p.seq_ctx2 ? MAX_K_LEVEL_CTX2 : MAX_K_LEVEL) || p.klevel < 1) {
             printf( "Unexpected quality compression level %d\n",
                     p.klevel);
             return 1;
@@ -899,20 +1425,99 @@ int main (int argc, char **argv) {
         p.llevel = magic[6] & 0x0f;
 
         p.max_comp = magic[7] & 0x0f;
+        if (p.max_comp && p.extract_last) {
+            printf( "Abort: reads can only be extracted from fast mode archives.\n");
+            return 1;
+        }
 
         p.blk_upd_thresh = magic[8] & 0xff;
 
-        printf("Parameters - k: %d, l: %d, b: %d \n", p.klevel, p.llevel, p.blk_upd_thresh);
+        p.blk_size = DEFAULT_BLK_SIZE;
+        if (magic[7] & HDR_BLK_SIZE) {
+            unsigned char len_buf[4];
+            if (4 != xread(in_fd, (char *) len_buf, 4)) {
+                printf( "Abort: truncated read.\n");
+                return 1;
+            }
+            p.blk_size = DECODE_INT(len_buf);
+        }
+
+        p.seq_lanes = 1;
+        if (magic[7] & HDR_SEQ_LANES) {
+            if (1 != xread(in_fd, (char *) &p.seq_lanes, 1)) {
+                printf( "Abort: truncated read.\n");
+                return 1;
+            }
+            if (p.seq_lanes < 1 || p.seq_lanes > MAX_SEQ_LANES) {
+                printf( "Unexpected number of sequence lanes %d\n", p.seq_lanes);
+                return 1;
+            }
+        }
+
+        p.rans = magic[7] & HDR_RANS;
+
+        p.mc_streams = 1;
+        if (magic[5] & HDR_MC_STREAMS) {
+            unsigned char mc_buf[2];
+            if (2 != xread(in_fd, (char *) mc_buf, 2)) {
+                printf( "Abort: truncated read.\n");
+                return 1;
+            }
+            p.mc_streams = mc_buf[0];
+            p.mc_sync = mc_buf[1];
+            if (p.mc_streams < 1 || p.mc_streams > MAX_MC_STREAMS || p.mc_sync < 1) {
+                printf( "Unexpected max compression streams %d, every %d rounds\n", p.mc_streams, p.mc_sync);
+                return 1;
+            }
+        }
+
+        /* The models of a model file must be the ones the archive was coded with */
+        if (magic[5] & HDR_MODEL) {
+            unsigned char crc_buf[4];
+            if (4 != xread(in_fd, (char *) crc_buf, 4)) {
+                printf( "Abort: truncated read.\n");
+                return 1;
+            }
+            if (!model_path) {
+                printf( "Abort: the archive was coded with the models of a model file, see --model.\n");
+                return 1;
+            }
+            if (load_model(model_path, &model) != 0)
+                return 1;
+            if (model.crc != (uint32_t) DECODE_INT(crc_buf)) {
+                printf( "Abort: %s is not the model file the archive was coded with.\n", model_path);
+                return 1;
+            }
+            p.model = &model;
+        }
+
+        if (magic[5] & HDR_EMBED_MODEL) {
+            if (p.model || read_embedded_model(in_fd, &model, &p) != 0)
+                return 1;
+            if (model.klevel != p.klevel || model.llevel != p.llevel || model.seq_ctx2 != p.seq_ctx2) {
+                printf( "Abort: the embedded models do not match the archive levels.\n");
+                return 1;
+            }
+            p.model = &model;
+        }
+
+        /* Read by the decoder if the archive is seekable */
+        if (magic[5] & HDR_INDEX)
+            p.index = &index;
+
+        printf("Parameters - k: %d, l: %d, b: %d, s: %u \n", p.klevel, p.llevel, p.blk_upd_thresh, p.blk_size);
 
         B_CTX_LEN = p.llevel;
         B_CTX = (1 << (B_CTX_LEN * A_LOG));
         AVG_CANT = (B_CTX * Q_CTX);
-        NS_MODEL_SIZE = pow5[p.klevel];
+        NS_MODEL_SIZE = SEQ_MODEL_SIZE(p.klevel, p.seq_ctx2);
 
         if (p.max_comp)
             res = decode_st(in_fd, out_fd, &p);
         else
             res = decode(in_fd, out_fd, &p);
+        if (p.model)
+            free_model(p.model);
 #ifdef __DEBUG_LOG__
         fclose(fp_log_debug);
 #endif
@@ -920,33 +1525,97 @@ int main (int argc, char **argv) {
 #ifdef __DEBUG_LOG__
         fp_log_debug = fopen("encode_log.txt", "wt");
 #endif
-        unsigned char magic[9] = {'.', 'e', 'n', 'a',
+        /* The levels of a model file replace those of the command line */
+        if (model_path) {
+            if (load_model(model_path, &model) != 0)
+                return 1;
+            p.klevel = model.klevel;
+            p.llevel = model.llevel;
+            p.seq_ctx2 = model.seq_ctx2;
+            p.model = &model;
+        }
+
+        unsigned char magic[9 + 4 + 1 + 2 + 4] = {'.', 'e', 'n', 'a',
                                   MAJOR_VERS,
                                   (unsigned char) p.klevel, (unsigned char) p.llevel, (unsigned char) p.max_comp, (unsigned char) p.blk_upd_thresh
         };
+        int hdr_len = 9;
+
+        if (p.seq_ctx2)
+            magic[7] |= HDR_SEQ_CTX2;
 
-        if (9 != write(out_fd, magic, 9)) {
+        /* Archives with the default block size keep the original header */
+        if (p.blk_size != DEFAULT_BLK_SIZE) {
+            magic[7] |= HDR_BLK_SIZE;
+            for (int i = 0; i < 4; i++)
+                magic[hdr_len++] = (p.blk_size >> (8 * i)) & 0xff;
+        }
+
+        if (p.seq_lanes > 1) {
+            magic[7] |= HDR_SEQ_LANES;
+            magic[hdr_len++] = p.seq_lanes;
+        }
+
+        /* Only fast mode freezes the models */
+        if (p.max_comp)
+            p.rans = false;
+        if (p.rans)
+            magic[7] |= HDR_RANS;
+
+        if (!p.max_comp)
+            p.mc_streams = 1;
+        if (p.mc_streams > 1) {
+            magic[5] |= HDR_MC_STREAMS;
+            magic[hdr_len++] = p.mc_streams;
+            magic[hdr_len++] = p.mc_sync;
+        }
+
+        /* An archive with its own models does not need the model file */
+        if (p.embed_model) {
+            magic[5] |= HDR_EMBED_MODEL;
+        } else if (p.model) {
+            magic[5] |= HDR_MODEL;
+            for (int i = 0; i < 4; i++)
+                magic[hdr_len++] = (p.model->crc >> (8 * i)) & 0xff;
+        }
+
+        if (want_index) {
+            magic[5] |= HDR_INDEX;
+            index_start(&index, hdr_len);
+            p.index = &index;
+        }
+
+        if (hdr_len != xwrite(out_fd, (char *) magic, hdr_len)) {
             printf( "Abort: truncated write.\n");
             return 1;
         }
 
-        printf("Parameters - k: %d, l: %d, b: %d \n", p.klevel, p.llevel, p.blk_upd_thresh);
+        printf("Parameters - k: %d, l: %d, b: %d, s: %u \n", p.klevel, p.llevel, p.blk_upd_thresh, p.blk_size);
 
         B_CTX_LEN = p.llevel;
         B_CTX = (1 << (B_CTX_LEN * A_LOG));
         AVG_CANT = (B_CTX * Q_CTX);
-        NS_MODEL_SIZE = pow5[p.klevel];
+        NS_MODEL_SIZE = SEQ_MODEL_SIZE(p.klevel, p.seq_ctx2);
+
+        fq_input in;
+        open_input(&in, in_fd, p.num_threads, p.blk_size);
 
         if (p.max_comp)
-            res = encode_st(in_fd, out_fd, &p);
+            res = encode_st(&in, out_fd, &p);
         else
-            res = encode(in_fd, out_fd, &p);
+            res = encode(&in, out_fd, &p);
+
+        close_input(&in);
+        if (p.model)
+            free_model(p.model);
+
+        if (res == 0 && p.index && write_index(out_fd, p.index) != 0)
+            res = -1;
 
 #ifdef __DEBUG_LOG__
         fclose(fp_log_debug);
 #endif
     }
 
-    delete in_buf;
     return res;
 }
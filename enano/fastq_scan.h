@@ -0,0 +1,107 @@
+// MIT License
+
+// Copyright (c) 2020 Guillermo Dufort y Álvarez
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+/*
+ * Newline scanner used to split FASTQ blocks into lines.
+ *
+ * Newlines are located 64 bytes at a time as a bit mask, built with AVX2 or
+ * SSE2 compares when the target supports them and with a scalar fallback
+ * otherwise, and then popped one by one with a count-trailing-zeros.
+ * The scanner never reads past the end of the buffer, so it is safe on
+ * memory mapped input.
+ */
+
+#ifndef ENANO_FASTQ_SCAN_H
+#define ENANO_FASTQ_SCAN_H
+
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Bit i is set if p[i] == '\n', for the len <= 64 bytes starting at p. */
+static inline uint64_t nl_mask_tail(const char *p, int len) {
+    uint64_t mask = 0;
+    for (int i = 0; i < len; i++)
+        if (p[i] == '\n')
+            mask |= 1ULL << i;
+    return mask;
+}
+
+/* Same as nl_mask_tail for 64 bytes. */
+static inline uint64_t nl_mask64(const char *p) {
+#if defined(__AVX2__)
+    const __m256i nl = _mm256_set1_epi8('\n');
+    uint32_t lo = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), nl));
+    uint32_t hi = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 32)), nl));
+    return ((uint64_t) hi << 32) | lo;
+#elif defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n');
+    uint64_t m0 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), nl));
+    uint64_t m1 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 16)), nl));
+    uint64_t m2 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 32)), nl));
+    uint64_t m3 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 48)), nl));
+    return m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+#else
+    return nl_mask_tail(p, 64);
+#endif
+}
+
+struct NL_SCANNER {
+    const char *buf;
+    int len;
+    int base;       // Position of bit 0 of mask
+    uint64_t mask;  // Newlines not returned yet in buf[base..base+63]
+
+    NL_SCANNER(const char *b, int l) : buf(b), len(l) {
+        seek(0);
+    }
+
+    /* Restarts the scan at pos. */
+    inline void seek(int pos) {
+        base = pos;
+        mask = load(pos);
+    }
+
+    /* Returns the position of the next newline, or len if there is none. */
+    inline int next() {
+        while (mask == 0) {
+            base += 64;
+            if (base >= len)
+                return len;
+            mask = load(base);
+        }
+        int pos = base + __builtin_ctzll(mask);
+        mask &= mask - 1;
+        return pos;
+    }
+
+private:
+    inline uint64_t load(int pos) {
+        if (pos >= len)
+            return 0;
+        return (len - pos >= 64) ? nl_mask64(buf + pos) : nl_mask_tail(buf + pos, len - pos);
+    }
+};
+
+#endif //ENANO_FASTQ_SCAN_H
@@ -0,0 +1,454 @@
+// MIT License
+
+// Copyright (c) 2020 Guillermo Dufort y Álvarez
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "Compressor.h"
+#include "fq_input.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Reads from the input file, starting with the bytes peeked by open_input(). */
+static ssize_t raw_read(fq_input *in, char *buf, size_t count) {
+    size_t from_peek = MIN(count, in->peek_len - in->peek_pos);
+    memcpy(buf, in->peek + in->peek_pos, from_peek);
+    in->peek_pos += from_peek;
+    if (from_peek == count)
+        return count;
+
+    ssize_t sz = xread(in->fd, buf + from_peek, count - from_peek);
+    return sz < 0 ? sz : (ssize_t) from_peek + sz;
+}
+
+#define LE16(p) ((p)[0] + ((p)[1] << 8))
+#define LE32(p) ((uint32_t) (p)[0] + ((uint32_t) (p)[1] << 8) + ((uint32_t) (p)[2] << 16) + ((uint32_t) (p)[3] << 24))
+
+/*
+ * Streams a gzip file, possibly made of several members, through inflate.
+ */
+static ssize_t gzip_read(fq_input *in, char *buf, size_t count) {
+    z_stream *zs = in->zs;
+    zs->next_out = (Bytef *) buf;
+    zs->avail_out = count;
+
+    while (zs->avail_out > 0) {
+        if (zs->avail_in == 0) {
+            ssize_t sz = raw_read(in, in->zbuf, GZ_BUF_SIZE);
+            if (sz < 0)
+                return -1;
+            if (sz == 0) {
+                if (in->z_member_open) {
+                    printf( "Abort: truncated gzip input.\n");
+                    return -1;
+                }
+                break;
+            }
+            zs->next_in = (Bytef *) in->zbuf;
+            zs->avail_in = sz;
+        }
+
+        int ret = inflate(zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            in->z_member_open = false;
+            inflateReset(zs);
+        } else if (ret == Z_OK || ret == Z_BUF_ERROR) {
+            in->z_member_open = true;
+        } else {
+            printf( "Abort: corrupt gzip input.\n");
+            return -1;
+        }
+    }
+
+    return count - zs->avail_out;
+}
+
+/*
+ * Reads the next batch of up to BGZF_BATCH blocks and inflates them in
+ * parallel into gz_out. Every BGZF block is an independent gzip member that
+ * records its compressed and uncompressed sizes, so the blocks can be split
+ * and placed in the output before inflating any of them.
+ */
+static bool bgzf_fill(fq_input *in) {
+    size_t comp_len = 0;
+    int n = 0;
+
+    while (n < BGZF_BATCH) {
+        unsigned char *h = (unsigned char *) in->zbuf + comp_len;
+        ssize_t sz = raw_read(in, (char *) h, 12);
+        if (sz == 0)
+            break;
+        if (sz != 12 || h[0] != 0x1f || h[1] != 0x8b || !(h[3] & 4)) {
+            printf( "Abort: corrupt BGZF input.\n");
+            return false;
+        }
+
+        uint xlen = LE16(h + 10);
+        if (raw_read(in, (char *) h + 12, xlen) != (ssize_t) xlen) {
+            printf( "Abort: truncated BGZF input.\n");
+            return false;
+        }
+
+        /* BSIZE is the total block size minus one, in the BC extra subfield */
+        long bsize = -1;
+        for (uint x = 0; x + 4 <= xlen; x += 4 + LE16(h + 12 + x + 2)) {
+            unsigned char *sf = h + 12 + x;
+            if (sf[0] == 'B' && sf[1] == 'C' && LE16(sf + 2) == 2)
+                bsize = LE16(sf + 4) + 1;
+        }
+        long rest = bsize - 12 - xlen;
+        if (bsize < 0 || rest < 8) {
+            printf( "Abort: corrupt BGZF input.\n");
+            return false;
+        }
+        if (raw_read(in, (char *) h + 12 + xlen, rest) != rest) {
+            printf( "Abort: truncated BGZF input.\n");
+            return false;
+        }
+
+        in->bgzf_hdr[n] = 12 + xlen;
+        in->bgzf_off[n] = comp_len;
+        in->bgzf_len[n] = bsize;
+        comp_len += bsize;
+        n++;
+    }
+
+    size_t *out_off = in->bgzf_out_off;
+    out_off[0] = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned char *blk = (unsigned char *) in->zbuf + in->bgzf_off[i];
+        out_off[i + 1] = out_off[i] + LE32(blk + in->bgzf_len[i] - 4);
+        if (out_off[i + 1] - out_off[i] > BGZF_MAX_BLOCK) {
+            printf( "Abort: corrupt BGZF input.\n");
+            return false;
+        }
+    }
+
+    std::atomic<bool> failed(false);
+    #pragma omp parallel for num_threads(in->threads) schedule(dynamic)
+    for (int i = 0; i < n; i++) {
+        unsigned char *blk = (unsigned char *) in->zbuf + in->bgzf_off[i];
+        uint hdr = in->bgzf_hdr[i];
+        uint32_t isize = out_off[i + 1] - out_off[i];
+        Bytef *out = (Bytef *) in->gz_out + out_off[i];
+
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, -15) != Z_OK) {
+            failed = true;
+            continue;
+        }
+        zs.next_in = blk + hdr;
+        zs.avail_in = in->bgzf_len[i] - hdr - 8;
+        zs.next_out = out;
+        zs.avail_out = isize;
+        int ret = inflate(&zs, Z_FINISH);
+        if (ret != Z_STREAM_END || zs.total_out != isize ||
+            crc32(0, out, isize) != LE32(blk + in->bgzf_len[i] - 8))
+            failed = true;
+        inflateEnd(&zs);
+    }
+
+    if (failed) {
+        printf( "Abort: corrupt BGZF input.\n");
+        return false;
+    }
+
+    in->gz_out_len = out_off[n];
+    in->gz_out_pos = 0;
+    in->z_member_open = (n > 0);
+    return true;
+}
+
+static ssize_t bgzf_read(fq_input *in, char *buf, size_t count) {
+    size_t done = 0;
+    while (done < count) {
+        if (in->gz_out_pos == in->gz_out_len) {
+            if (!bgzf_fill(in))
+                return -1;
+            if (in->gz_out_len == 0 && !in->z_member_open)
+                break;
+            continue;
+        }
+        size_t len = MIN(count - done, in->gz_out_len - in->gz_out_pos);
+        memcpy(buf + done, in->gz_out + in->gz_out_pos, len);
+        in->gz_out_pos += len;
+        done += len;
+    }
+    return done;
+}
+
+/* Reads decompressed FASTQ data. Short counts only happen at the end. */
+static ssize_t input_read(fq_input *in, char *buf, size_t count) {
+    switch (in->format) {
+        case FQ_GZIP:
+            return gzip_read(in, buf, count);
+        case FQ_BGZF:
+            return bgzf_read(in, buf, count);
+        default:
+            return raw_read(in, buf, count);
+    }
+}
+
+void open_input(fq_input *in, int fd, int threads, size_t blk_size) {
+    struct stat st;
+
+    in->fd = fd;
+    in->map = NULL;
+    in->map_len = 0;
+    in->chunk = NULL;
+    in->win = NULL;
+    in->win_len = in->pos = 0;
+    in->eof = false;
+    in->error = false;
+    //BGZF is inflated alongside the coding threads, so it gets a share of them
+    in->threads = MAX(1, threads / 4);
+    in->blk_size = blk_size;
+    in->format = FQ_RAW;
+    in->zs = NULL;
+    in->zbuf = in->gz_out = NULL;
+    in->gz_out_len = in->gz_out_pos = 0;
+    in->z_member_open = false;
+
+    /* Peek at the first bytes to detect gzip, they are replayed by raw_read() */
+    ssize_t sz = xread(fd, in->peek, sizeof(in->peek));
+    in->peek_len = sz < 0 ? 0 : sz;
+    in->peek_pos = 0;
+
+    unsigned char *h = (unsigned char *) in->peek;
+    if (in->peek_len >= 18 && h[0] == 0x1f && h[1] == 0x8b) {
+        if ((h[3] & 4) && LE16(h + 10) == 6 && h[12] == 'B' && h[13] == 'C') {
+            in->format = FQ_BGZF;
+            in->zbuf = new char[(size_t) BGZF_BATCH * BGZF_MAX_BLOCK];
+            in->gz_out = new char[(size_t) BGZF_BATCH * BGZF_MAX_BLOCK];
+            printf("Reading BGZF compressed input with %d threads.\n", in->threads);
+        } else {
+            in->format = FQ_GZIP;
+            in->zbuf = new char[GZ_BUF_SIZE];
+            in->zs = new z_stream;
+            memset(in->zs, 0, sizeof(z_stream));
+            inflateInit2(in->zs, 15 + 16);
+            printf("Reading gzip compressed input.\n");
+        }
+        return;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            in->map = in->win = (char *) map;
+            in->map_len = in->win_len = st.st_size;
+            in->eof = true;
+        }
+    }
+}
+
+static void release_chunk(fq_chunk *chunk) {
+    if (chunk && --chunk->refs == 0) {
+        delete [] chunk->data;
+        delete chunk;
+    }
+}
+
+void close_input(fq_input *in) {
+    if (in->map)
+        munmap(in->map, in->map_len);
+    release_chunk(in->chunk);
+    if (in->zs) {
+        inflateEnd(in->zs);
+        delete in->zs;
+    }
+    delete [] in->zbuf;
+    delete [] in->gz_out;
+    in->map = NULL;
+    in->chunk = NULL;
+    in->zs = NULL;
+    in->zbuf = in->gz_out = NULL;
+}
+
+/*
+ * Moves the unsliced tail of the window to a new chunk and fills the rest of
+ * it from the input. The old chunk stays alive while blocks still use it.
+ */
+static bool refill(fq_input *in) {
+    size_t tail = in->win_len - in->pos;
+    size_t size = MAX(PARSE_CHUNK_BLOCKS * in->blk_size, 2 * tail);
+
+    fq_chunk *chunk = new fq_chunk;
+    chunk->data = new char[size];
+    chunk->refs = 1;
+    memcpy(chunk->data, in->win + in->pos, tail);
+
+    errno = 0;
+    ssize_t sz = input_read(in, chunk->data + tail, size - tail);
+    if (sz < 0) {
+        if (errno)   // Decompression errors are reported where they happen
+            printf( "Abort: read failed, %d.\n", errno);
+        release_chunk(chunk);
+        in->error = true;
+        return false;
+    }
+    in->eof = ((size_t) sz < size - tail);
+
+    release_chunk(in->chunk);
+    in->chunk = chunk;
+    in->win = chunk->data;
+    in->win_len = tail + sz;
+    in->pos = 0;
+    return true;
+}
+
+/*
+ * Length of the read starting at buf[0], including its last newline.
+ * Returns 0 if buf does not start with a well formed read, and -1 if the
+ * buffer ends before the read does.
+ */
+static long read_length(const char *buf, size_t len, bool at_eof) {
+    int scan_len = (int) MIN(len, (size_t) 1 << 30);
+    NL_SCANNER nl(buf, scan_len);
+
+    if (buf[0] != '@')
+        return 0;
+
+    int name_end = nl.next();
+    int seq_end = nl.next();
+    if (seq_end + 1 >= scan_len)
+        return -1;
+    if (buf[seq_end + 1] != '+')
+        return 0;
+
+    int plus_end = nl.next();
+    if (plus_end >= scan_len)
+        return -1;
+
+    long qual_end = plus_end + 1 + (seq_end - name_end - 1);
+    if (qual_end > scan_len || (qual_end == scan_len && !at_eof))
+        return -1;
+    if (qual_end == scan_len)
+        return qual_end;
+    if (buf[qual_end] != '\n')
+        return 0;
+
+    return qual_end + 1;
+}
+
+/*
+ * Returns the first read start at or after pos in buf[0..len-1], len if there
+ * is none and the input ends there, or -1 if more data is needed.
+ */
+static long find_read_start(const char *buf, size_t len, size_t pos, bool at_eof) {
+    while (pos < len) {
+        if (pos > 0 && buf[pos - 1] != '\n') {
+            const char *nl = (const char *) memchr(buf + pos, '\n', len - pos);
+            if (!nl)
+                break;
+            pos = nl - buf + 1;
+            continue;
+        }
+        long r = read_length(buf + pos, len - pos, at_eof);
+        if (r > 0)
+            return pos;
+        if (r < 0)
+            return at_eof ? len : -1;
+        pos++;
+    }
+    return at_eof ? len : -1;
+}
+
+/*
+ * End of the last read starting at pos that fits in limit bytes. Only used
+ * when a resynchronised block comes out larger than the block size.
+ * A read longer than limit gets a block of its own.
+ */
+static size_t last_read_end(const char *buf, size_t len, size_t pos, size_t limit) {
+    size_t end = pos;
+    long r;
+    while ((r = read_length(buf + end, len - end, true)) > 0 && (end + r - pos <= limit || end == pos))
+        end += r;
+    return end;
+}
+
+bool next_block(fq_input *in, Compressor *c) {
+    while (true) {
+        size_t avail = in->win_len - in->pos;
+        if (avail == 0 && in->eof)
+            return false;
+
+        size_t stride = BLK_STRIDE(in->blk_size);
+        long cut = -1;
+        if (avail > stride)
+            cut = find_read_start(in->win, in->win_len, in->pos + stride, in->eof);
+        else if (in->eof)
+            cut = in->win_len;
+
+        if (cut < 0) {
+            if (!refill(in))
+                return false;
+            continue;
+        }
+
+        if ((size_t) cut - in->pos > in->blk_size) {
+            cut = last_read_end(in->win, cut, in->pos, in->blk_size);
+            if ((size_t) cut == in->pos) {
+                printf( "Abort: malformed read in the input.\n");
+                in->error = true;
+                return false;
+            }
+        }
+
+        c->blk_in = in->win + in->pos;
+        c->blk_in_len = cut - in->pos;
+        c->blk_at_eof = in->eof && ((size_t) cut == in->win_len);
+        c->blk_chunk = in->chunk;
+        if (in->chunk)
+            in->chunk->refs++;
+
+        in->pos = cut;
+        return true;
+    }
+}
+
+void release_block(Compressor *c) {
+    release_chunk(c->blk_chunk);
+    c->blk_chunk = NULL;
+}
+
+void keep_block(Compressor *c, fq_slice *s) {
+    s->in = c->blk_in;
+    s->len = c->blk_in_len;
+    s->at_eof = c->blk_at_eof;
+    s->chunk = c->blk_chunk;
+    c->blk_chunk = NULL;
+}
+
+void restore_block(Compressor *c, fq_slice *s) {
+    c->blk_in = s->in;
+    c->blk_in_len = s->len;
+    c->blk_at_eof = s->at_eof;
+    c->blk_chunk = s->chunk;
+    s->chunk = NULL;
+}
+
+void release_slice(fq_slice *s) {
+    release_chunk(s->chunk);
+    s->chunk = NULL;
+}
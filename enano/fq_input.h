@@ -0,0 +1,117 @@
+// MIT License
+
+// Copyright (c) 2020 Guillermo Dufort y Álvarez
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+/*
+ * FASTQ input of the encoder.
+ *
+ * Regular files are memory mapped; other inputs are read in chunks of
+ * PARSE_CHUNK_BLOCKS blocks. Either way the blocks are slices of the input
+ * that the coding threads parse in place, so the reader only has to find
+ * where each block ends.
+ *
+ * Block ends are found speculatively: the reader jumps BLK_STRIDE bytes
+ * ahead and resynchronises to the next line that starts a well formed read
+ * ('@' line, sequence, '+' line and a quality line of the same length). The
+ * boundaries only depend on the data, so the blocks are the same whatever
+ * the input type or the number of threads.
+ *
+ * gzip compressed input is inflated on the fly. BGZF input (bgzip), whose
+ * members are small and independent, is inflated in batches of BGZF_BATCH
+ * members by several threads.
+ */
+
+#ifndef ENANO_FQ_INPUT_H
+#define ENANO_FQ_INPUT_H
+
+#include <stddef.h>
+#include <atomic>
+#include <zlib.h>
+
+class Compressor;
+
+#define GZ_BUF_SIZE (1 << 20)
+#define BGZF_MAX_BLOCK (1 << 16)
+#define BGZF_BATCH 64
+
+enum fq_format { FQ_RAW, FQ_GZIP, FQ_BGZF };
+
+/* Input buffer shared by the blocks sliced from it. */
+struct fq_chunk {
+    char *data;
+    std::atomic<int> refs;
+};
+
+typedef struct {
+    int fd;
+    char *map;          // Mapped input file, NULL when reading from fd
+    size_t map_len;
+    fq_chunk *chunk;    // Chunk being sliced when reading from fd
+    char *win;          // Data available, either map or chunk->data
+    size_t win_len;
+    size_t pos;         // Start of the next block in win
+    bool eof;           // Nothing left to read after win
+    bool error;
+    size_t blk_size;    // Target block size, only exceeded by blocks of a single read
+
+    int threads;        // Threads used to inflate BGZF input, a quarter of -t
+    fq_format format;
+    char peek[18];      // First bytes of the input, read to detect its format
+    size_t peek_len, peek_pos;
+    z_stream *zs;       // Streaming inflate state for gzip input
+    char *zbuf;         // Compressed input
+    char *gz_out;       // Inflated BGZF batch
+    size_t gz_out_len, gz_out_pos;
+    bool z_member_open; // Inside a gzip member, EOF here means truncated input
+    uint bgzf_hdr[BGZF_BATCH];
+    size_t bgzf_off[BGZF_BATCH], bgzf_len[BGZF_BATCH];
+    size_t bgzf_out_off[BGZF_BATCH + 1];
+} fq_input;
+
+void open_input(fq_input *in, int fd, int threads, size_t blk_size);
+
+void close_input(fq_input *in);
+
+/* Slices the next block of the input into c. Returns false at the end of
+ * the input or on failure, in which case in->error is set. */
+bool next_block(fq_input *in, Compressor *c);
+
+/* Releases the input of the block sliced into c once it has been coded. */
+void release_block(Compressor *c);
+
+/* Input slice of a block, kept to code the block again later. */
+typedef struct {
+    char *in;
+    int len;
+    bool at_eof;
+    fq_chunk *chunk;
+} fq_slice;
+
+/* Moves the input slice of c into s, instead of releasing it. */
+void keep_block(Compressor *c, fq_slice *s);
+
+/* Hands the slice s back to c, which parses it and releases it as usual. */
+void restore_block(Compressor *c, fq_slice *s);
+
+void release_slice(fq_slice *s);
+
+#endif //ENANO_FQ_INPUT_H
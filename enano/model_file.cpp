@@ -0,0 +1,342 @@
+// MIT License
+
+// Copyright (c) 2020 Guillermo Dufort y Álvarez
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "Compressor.h"
+#include "model_file.h"
+
+#include <sys/stat.h>
+#include <zlib.h>
+
+extern uint AVG_CANT, NS_MODEL_SIZE;
+extern uint16_t* ctx_avgs_sums;
+extern uint16_t* ctx_avgs_err_sums;
+extern uint32_t* ctx_err_avgs_total;
+
+/*
+ * The same walk over the models sizes, saves or loads them, so the three
+ * always agree on the layout.
+ */
+enum { MIO_SIZE, MIO_SAVE, MIO_LOAD };
+
+struct model_io {
+    int mode;
+    unsigned char *p;
+    size_t len;
+};
+
+/* Little endian integer of the given number of bytes */
+template <class T>
+static inline void io_int(model_io *io, T &v, int bytes = sizeof(T)) {
+    if (io->mode == MIO_SAVE) {
+        for (int i = 0; i < bytes; i++)
+            io->p[i] = (v >> (8 * i)) & 0xff;
+    } else if (io->mode == MIO_LOAD) {
+        uint32_t x = 0;
+        for (int i = 0; i < bytes; i++)
+            x |= (uint32_t) io->p[i] << (8 * i);
+        v = x;
+    }
+    if (io->mode != MIO_SIZE)
+        io->p += bytes;
+    io->len += bytes;
+}
+
+template <int NSYM>
+static void io_model(model_io *io, SIMPLE_MODEL<NSYM> &m) {
+    uint32_t tot = 0;
+    for (int i = 0; i < NSYM; i++) {
+        io_int(io, m.F[i].Symbol, 1);
+        io_int(io, m.F[i].Freq);
+        if (io->mode == MIO_LOAD)
+            tot += m.F[i].Freq;
+    }
+    if (io->mode == MIO_LOAD) {
+        m.TotFreq = tot;
+        m.BubCnt = 0;
+    }
+}
+
+/* Serialised length of a SIMPLE_MODEL, a byte per symbol and its frequency */
+template <int NSYM>
+static size_t model_size() {
+    return NSYM * (1 + sizeof(SIMPLE_MODEL<NSYM>::SymFreqs::Freq));
+}
+
+static void io_models(model_io *io, context_models *cm) {
+    uint i;
+    io_model(io, cm->model_len1);
+    io_model(io, cm->model_len2);
+    io_model(io, cm->model_len3);
+    io_model(io, cm->model_same_len);
+
+    for (i = 0; i < 256; i++) {
+        io_model(io, cm->model_name_prefix[i]);
+        io_model(io, cm->model_name_suffix[i]);
+        io_model(io, cm->model_name_len[i]);
+    }
+    for (i = 0; i < 8192; i++)
+        io_model(io, cm->model_name_middle[i]);
+
+    for (i = 0; i < CTX_CNT; i++)
+        io_model(io, cm->model_qual_quant[i]);
+    io_model(io, cm->quant_top);
+
+    for (size_t c = 0; c < NS_MODEL_SIZE; c++) {
+        for (int j = 0; j < 5; j++)
+            io_int(io, cm->model_seq8[c].Stats[j]);
+    }
+
+    for (i = 0; i < AVG_CANT; i++) {
+        io_int(io, ctx_avgs_sums[i]);
+        io_int(io, ctx_avgs_err_sums[i]);
+    }
+    for (i = 0; i < Q_CTX; i++)
+        io_int(io, ctx_err_avgs_total[i]);
+}
+
+static uint32_t model_crc(const char *data, size_t len) {
+    uLong crc = crc32(0, Z_NULL, 0);
+    while (len > 0) {
+        uInt n = MIN(len, (size_t) 1 << 30);
+        crc = crc32(crc, (const Bytef *) data, n);
+        data += n;
+        len -= n;
+    }
+    return crc;
+}
+
+/*
+ * Image of the model file of cm, returned in *out, to be freed with delete [].
+ * Returns its length, or 0 on failure.
+ */
+static size_t pack_model(context_models *cm, enano_params *p, unsigned char **out) {
+    model_io io = {MIO_SIZE, NULL, 0};
+    io_models(&io, cm);
+    size_t len = io.len;
+
+    unsigned char *data = new unsigned char[len];
+    io.mode = MIO_SAVE;
+    io.p = data;
+    io.len = 0;
+    io_models(&io, cm);
+
+    uLongf zlen = compressBound(len);
+    *out = new unsigned char[MODEL_HDR_LEN + zlen];
+
+    if (compress2(*out + MODEL_HDR_LEN, &zlen, data, len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        printf( "Abort: could not deflate the models.\n");
+        delete [] data;
+        delete [] *out;
+        *out = NULL;
+        return 0;
+    }
+
+    uint32_t crc = model_crc((char *) data, len);
+    unsigned char *hdr = *out;
+    memcpy(hdr, ".enm", 4);
+    hdr[4] = MAJOR_VERS;
+    hdr[5] = p->klevel | (p->seq_ctx2 ? MODEL_SEQ_CTX2 : 0);
+    hdr[6] = p->llevel;
+    hdr[7] = 0;
+    for (int i = 0; i < 8; i++)
+        hdr[8 + i] = ((uint64_t) len >> (8 * i)) & 0xff;
+    for (int i = 0; i < 4; i++)
+        hdr[16 + i] = (crc >> (8 * i)) & 0xff;
+
+    delete [] data;
+    return MODEL_HDR_LEN + zlen;
+}
+
+/*
+ * Length of the serialised models of the given levels, as io_models() walks
+ * them, so it is known before any model is set up.
+ */
+static size_t model_len(uint8_t klevel, uint8_t llevel, bool seq_ctx2) {
+    size_t seq_models = SEQ_MODEL_SIZE(klevel, seq_ctx2);
+    size_t avg_cant = (size_t) (1 << (llevel * A_LOG)) * Q_CTX;
+    return 3 * model_size<256>() + model_size<2>()
+           + 3 * 256 * model_size<256>() + 8192 * model_size<128>()
+           + CTX_CNT * model_size<QUANT_D_CANT>() + model_size<QMAX - QUANT_D_CANT>()
+           + seq_models * sizeof(BASE_MODEL<uint8_t>::Stats)
+           + avg_cant * 2 * sizeof(uint16_t) + Q_CTX * sizeof(uint32_t);
+}
+
+/* Reads the model file image of len bytes into m, name is for the messages */
+static int parse_model(const unsigned char *file, size_t zlen, model_file *m, const char *name) {
+    m->data = NULL;
+    if (zlen < MODEL_HDR_LEN) {
+        printf( "Abort: truncated model file %s.\n", name);
+        return -1;
+    }
+    if (memcmp(file, ".enm", 4) != 0 || file[4] != MAJOR_VERS) {
+        printf( "Abort: %s is not an enano model file.\n", name);
+        return -1;
+    }
+
+    m->seq_ctx2 = file[5] & MODEL_SEQ_CTX2;
+    m->klevel = file[5] & ~MODEL_SEQ_CTX2;
+    m->llevel = file[6];
+    uint64_t len = 0;
+    for (int i = 0; i < 8; i++)
+        len |= (uint64_t) file[8 + i] << (8 * i);
+    m->crc = DECODE_INT(file + 16);
+    m->len = len;
+    if (m->klevel < 1 || m->klevel > (m->seq_ctx2 ? MAX_K_LEVEL_CTX2 : MAX_K_LEVEL) || m->llevel > 0x0f) {
+        printf( "Abort: unexpected levels of the model file, k: %d, l: %d.\n", m->klevel, m->llevel);
+        return -1;
+    }
+
+    //The length is checked before it is allocated, a damaged header is only a corrupt file
+    if (len != model_len(m->klevel, m->llevel, m->seq_ctx2)) {
+        printf( "Abort: corrupt model file %s.\n", name);
+        return -1;
+    }
+
+    uLongf out_len = len;
+    m->data = new char[len];
+    if (uncompress((Bytef *) m->data, &out_len, file + MODEL_HDR_LEN, zlen - MODEL_HDR_LEN) != Z_OK
+        || out_len != len || model_crc(m->data, len) != m->crc) {
+        printf( "Abort: corrupt model file %s.\n", name);
+        free_model(m);
+        return -1;
+    }
+    return 0;
+}
+
+int save_model(const char *path, context_models *cm, enano_params *p) {
+    unsigned char *out;
+    ssize_t len = pack_model(cm, p, &out);
+    if (len == 0)
+        return -1;
+
+    int res = -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        perror(path);
+    } else {
+        if (xwrite(fd, (char *) out, len) == len && close(fd) == 0)
+            res = 0;
+        else
+            printf( "Abort: truncated write.\n");
+    }
+
+    delete [] out;
+    return res;
+}
+
+int load_model(const char *path, model_file *m) {
+    m->data = NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    size_t zlen = st.st_size;
+    unsigned char *file = new unsigned char[MAX(zlen, (size_t) 1)];
+    int res = -1;
+
+    if ((size_t) xread(fd, (char *) file, zlen) != zlen)
+        printf( "Abort: truncated model file %s.\n", path);
+    else
+        res = parse_model(file, zlen, m, path);
+
+    close(fd);
+    delete [] file;
+    return res;
+}
+
+ssize_t write_embedded_model(int fd, context_models *cm, enano_params *p) {
+    unsigned char *out;
+    size_t len = pack_model(cm, p, &out);
+    if (len == 0)
+        return -1;
+
+    unsigned char len_buf[8];
+    for (int i = 0; i < 8; i++)
+        len_buf[i] = ((uint64_t) len >> (8 * i)) & 0xff;
+
+    ssize_t res = 8 + len;
+    if (xwrite(fd, (char *) len_buf, 8) != 8 || xwrite(fd, (char *) out, len) != (ssize_t) len) {
+        printf( "Abort: truncated write.\n");
+        res = -1;
+    }
+
+    delete [] out;
+    return res;
+}
+
+int read_embedded_model(int fd, model_file *m, enano_params *p) {
+    m->data = NULL;
+
+    unsigned char len_buf[8];
+    if (xread(fd, (char *) len_buf, 8) != 8) {
+        printf( "Abort: truncated read.\n");
+        return -1;
+    }
+    uint64_t len = 0;
+    for (int i = 0; i < 8; i++)
+        len |= (uint64_t) len_buf[i] << (8 * i);
+    //The models of the archive levels, deflated, bound the length before it is allocated
+    if (len < MODEL_HDR_LEN || len > MODEL_HDR_LEN + compressBound(model_len(p->klevel, p->llevel, p->seq_ctx2))) {
+        printf( "Abort: corrupt embedded models.\n");
+        return -1;
+    }
+
+    unsigned char *file = new unsigned char[len];
+    int res = -1;
+    if ((uint64_t) xread(fd, (char *) file, len) != len)
+        printf( "Abort: truncated read.\n");
+    else
+        res = parse_model(file, len, m, "embedded in the archive");
+
+    delete [] file;
+    return res;
+}
+
+int unpack_model(model_file *m, context_models *cm) {
+    model_io io = {MIO_SIZE, NULL, 0};
+    io_models(&io, cm);
+    if (io.len != m->len) {
+        printf( "Abort: the model file does not match this version of enano.\n");
+        return -1;
+    }
+
+    io.mode = MIO_LOAD;
+    io.p = (unsigned char *) m->data;
+    io.len = 0;
+    io_models(&io, cm);
+    return 0;
+}
+
+void free_model(model_file *m) {
+    delete [] m->data;
+    m->data = NULL;
+}
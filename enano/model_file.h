@@ -0,0 +1,78 @@
+// MIT License
+
+// Copyright (c) 2020 Guillermo Dufort y Álvarez
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+/*
+ * Trained models of fast mode saved to a file, see --save-model and --model.
+ *
+ * The models are saved as the training leaves them, before they are frozen:
+ * the symbols and frequencies of every SIMPLE_MODEL in the model order, the
+ * stats of the sequence models and the quality averages. A run that loads
+ * them freezes them straight away, so every block is coded in parallel from
+ * the first one.
+ *
+ * File layout: ".enm", MAJOR_VERS, the k level (| MODEL_SEQ_CTX2 for -a),
+ * the l level, a zero byte, the length (8 bytes) and the crc32 (4 bytes) of
+ * the serialised models, little endian, and the models deflated with zlib.
+ */
+
+#ifndef ENANO_MODEL_FILE_H
+#define ENANO_MODEL_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MODEL_HDR_LEN 20
+#define MODEL_SEQ_CTX2 0x80
+
+struct model_file {
+    uint8_t klevel, llevel;
+    bool seq_ctx2;
+    uint32_t crc;   // crc32 of the serialised models, the archives coded with them keep it
+    char *data;     // Serialised models
+    size_t len;
+};
+
+/* Saves the models cm and the quality averages, trained with the parameters p.
+ * Returns 0 on success, -1 on failure. */
+int save_model(const char *path, context_models *cm, enano_params *p);
+
+/* Reads the model file path into m. Returns 0 on success, -1 on failure. */
+int load_model(const char *path, model_file *m);
+
+/* Writes the models cm, as a model file image after its 8 byte length, so
+ * that the archive holds its own models. Returns the bytes written, or -1 on
+ * failure. */
+ssize_t write_embedded_model(int fd, context_models *cm, enano_params *p);
+
+/* Reads the models that write_embedded_model() wrote into m, for an archive
+ * of the parameters p. Returns 0 on success, -1 on failure. */
+int read_embedded_model(int fd, model_file *m, enano_params *p);
+
+/* Copies the models of m into cm and the quality averages, which must have
+ * the sizes of the parameters of m. Returns 0 on success, -1 on failure. */
+int unpack_model(model_file *m, context_models *cm);
+
+void free_model(model_file *m);
+
+#endif //ENANO_MODEL_FILE_H
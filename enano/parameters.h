@@ -20,7 +20,14 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
-#define BLK_SIZE 10000000 //10 MB
+#define DEFAULT_BLK_SIZE 10000000 //10 MB, set with -s
+#define MIN_BLK_SIZE 4000
+#define MAX_BLK_SIZE (1 << 30)
+
+//Distance between the speculative block boundaries, leaves room for the read crossing it
+#define BLK_STRIDE(blk_size) ((blk_size) - (blk_size) / 8)
+//Blocks read at once when the input can't be memory mapped
+#define PARSE_CHUNK_BLOCKS 8
 
 //Default parameters
 #define DEFAULT_K_LEVEL 7
@@ -29,9 +36,33 @@
 #define DEFAULT_BLK_UPD_THRESH 32
 #define DEFAULT_BLK_UPD_FREQ 4
 
+//Blocks in flight besides the ones being coded: one being loaded and one being written
+#define PIPELINE_EXTRA_BLOCKS 2
+
+//Decoded blocks of at most OUT_IOV_READS reads averaging OUT_IOV_MIN_RECORD bytes or more
+//are written with writev straight from the decode buffers, others are copied to out_buf
+#define OUT_IOV_READS 4096
+#define OUT_IOV_MIN_RECORD 512
+
+//Bound of the range coder output for n coded symbols, each one costs at most 16 bits
+#define RC_OUT_BOUND(n) (2 * (size_t) (n) + 1024)
+//Longest name line of a decoded read, names are at most 255 characters plus '@' and '\n'
+#define MAX_NAME_LINE 257
+
 //#define __TIMING__
 //#define __ORDER_SYMBOLS__
 
+//Header flags, in the high nibble of the max_comp byte
+#define HDR_BLK_SIZE 0x10 // A 4 byte block size follows the header
+#define HDR_SEQ_CTX2 0x20 // 2 bit sequence contexts, see -a
+#define HDR_SEQ_LANES 0x40 // Bases coded in interleaved lanes, a 1 byte lane count follows the header
+#define HDR_RANS 0x80 // Blocks coded after training use static rANS, see -r
+//Header flags, in the high nibble of the klevel byte
+#define HDR_MC_STREAMS 0x10 // Max compression in parallel streams, 1 byte streams and 1 byte sync rounds follow the header
+#define HDR_MODEL 0x20 // Coded with the models of a model file, see --model, their 4 byte crc32 follows the header
+#define HDR_EMBED_MODEL 0x40 // The models follow the header and every block is coded with them, see --embed-model
+#define HDR_INDEX 0x80 // The blocks end with a 0 length, followed by the block index, see block_index.h
+
 #define MAJOR_VERS 1
 #define MINOR_VERS 0
 
@@ -53,6 +84,22 @@ static const unsigned int pow5[] = {
         1220703125
 };
 
+//Base sequence contexts: k bases of 5 symbols, or of 2 bits with N taken as A when using -a
+#define MAX_K_LEVEL 13
+#define MAX_K_LEVEL_CTX2 15
+#define SEQ_MODEL_SIZE(k, ctx2) ((ctx2) ? 1u << (2 * (k)) : pow5[k])
+//Interleaved lanes of reads for the sequence stream, see -L
+#define MAX_SEQ_LANES 16
+//Parallel streams of max compression mode, see -p, and rounds of blocks between their model mixes
+#define MAX_MC_STREAMS 64
+#define DEFAULT_MC_SYNC_ROUNDS 4
+//Sequence contexts per page, the unit in which training copies and mixes the sequence model
+#define SEQ_PAGE_SHIFT 12
+//Static rANS precision of the frozen model frequencies, see -r
+#define RANS_PROB_BITS 16
+//Largest frequency to symbol table of the frozen SIMPLE_MODELs, in bits, smaller models size theirs to NSYM
+#define DEC_LUT_BITS 8
+
 #define DUPLICATE_NAME_LINES
 //#define __GLOBAL_STATS__
 //#define __DEBUG_LOG__
@@ -96,5 +143,7 @@ static const unsigned int pow5[] = {
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
+//round(sum / n) of a non-negative sum in integers, it matches round() of the division
+#define MIX_ROUND(sum, n) ((2 * (sum) + (n)) / (2 * (n)))
 
 #define ABS(N) ((N<0)?(-N):(N))
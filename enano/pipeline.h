@@ -0,0 +1,122 @@
+// MIT License
+
+// Copyright (c) 2020 Guillermo Dufort y Álvarez
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+/*
+ * Queues used to connect the reader, coder and writer stages.
+ *
+ * BLOCK_QUEUE is a bounded blocking FIFO. Once closed, pushes are refused and
+ * pops drain the remaining items before failing.
+ *
+ * ORDERED_QUEUE hands items back in the order given by their block number,
+ * no matter in which order the coders finish them. The number of items in
+ * flight is bounded by the number of Compressors, so it needs no capacity.
+ */
+
+#ifndef ENANO_PIPELINE_H
+#define ENANO_PIPELINE_H
+
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+
+template <typename T>
+class BLOCK_QUEUE {
+public:
+    BLOCK_QUEUE(size_t capacity) : cap(capacity), closed(false) {}
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(m);
+        not_full.wait(lock, [this] { return closed || q.size() < cap; });
+        if (closed)
+            return false;
+        q.push_back(item);
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(m);
+        not_empty.wait(lock, [this] { return closed || !q.empty(); });
+        if (q.empty())
+            return false;
+        item = q.front();
+        q.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(m);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+    std::mutex m;
+    std::condition_variable not_empty, not_full;
+    std::deque<T> q;
+    size_t cap;
+    bool closed;
+};
+
+template <typename T>
+class ORDERED_QUEUE {
+public:
+    ORDERED_QUEUE() : next(0), closed(false) {}
+
+    void push(uint64_t id, T item) {
+        std::lock_guard<std::mutex> lock(m);
+        pending[id] = item;
+        if (id == next)
+            ready.notify_one();
+    }
+
+    /* Waits for the next block in order. Fails once closed and drained. */
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(m);
+        ready.wait(lock, [this] { return closed || pending.count(next); });
+        typename std::map<uint64_t, T>::iterator it = pending.find(next);
+        if (it == pending.end())
+            return false;
+        item = it->second;
+        pending.erase(it);
+        next++;
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(m);
+        closed = true;
+        ready.notify_all();
+    }
+
+private:
+    std::mutex m;
+    std::condition_variable ready;
+    std::map<uint64_t, T> pending;
+    uint64_t next;
+    bool closed;
+};
+
+#endif //ENANO_PIPELINE_H
@@ -0,0 +1,178 @@
+// MIT License
+
+// Copyright (c) 2020 Guillermo Dufort y Álvarez
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+/*
+ * Static rANS coder for the frozen models of fast mode.
+ *
+ * Once training is done the models don't change, so their frequencies are
+ * normalised to a power of two (see update_AccFreqs()) and coded with rANS,
+ * which decodes a symbol with a mask, a multiply and a table lookup instead
+ * of the division of the range coder. It is byte-wise rANS with 32 bit
+ * states as in Fabian Giesen's rans_byte.h, with two states interleaved on
+ * even and odd symbols so consecutive decodes don't depend on each other.
+ *
+ * RANS_ENC and RANS_DEC follow the RangeCoder interface so the models code
+ * with either of them. totFreq must be a power of two no larger than
+ * 1 << RANS_PROB_BITS, smaller ones are scaled up to it.
+ *
+ * rANS codes in reverse, so the encoder keeps the symbols of the stream and
+ * codes them backwards in FinishEncode(). The stream starts with the two
+ * final states, 4 bytes each.
+ */
+
+#ifndef ENANO_RANS_H
+#define ENANO_RANS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "buffers.h"
+
+// Lower bound of the normalised states
+#define RANS_L (1u << 23)
+
+/* Scales the n frequencies of f[] to add up to tot, keeping all of them at 1
+ * or more. Rounding is corrected on the largest ones. */
+static inline void rans_normalize(uint32_t *f, int n, uint32_t tot) {
+    uint64_t sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += f[i];
+    if (sum == 0)
+        sum = 1;
+
+    uint32_t out = 0;
+    for (int i = 0; i < n; i++) {
+        f[i] = ((uint64_t) f[i] * tot + sum / 2) / sum;
+        if (f[i] == 0)
+            f[i] = 1;
+        out += f[i];
+    }
+
+    while (out != tot) {
+        int m = 0;
+        for (int i = 1; i < n; i++)
+            if (f[i] > f[m])
+                m = i;
+        if (out < tot) {
+            f[m] += tot - out;
+            out = tot;
+        } else {
+            uint32_t d = out - tot < f[m] - 1 ? out - tot : f[m] - 1;
+            f[m] -= d;
+            out -= d;
+        }
+    }
+}
+
+class RANS_ENC {
+public:
+    RANS_ENC() : n(0), out_buf(NULL), out_len(0) {}
+
+    void output(char *out) { out_buf = out; }
+
+    int size_out(void) { return out_len; }
+
+    void StartEncode(void) { n = 0; }
+
+    /* Symbols are kept as start | freq << 16, scaled to RANS_PROB_BITS */
+    void Encode(uint cumFreq, uint freq, uint totFreq) {
+        uint shift = RANS_PROB_BITS - __builtin_ctz(totFreq);
+        if (n == syms.size())
+            syms.grow(n + 4096, n);
+        syms[n++] = (cumFreq << shift) | (freq << shift << 16);
+    }
+
+    void FinishEncode(void) {
+        /* At most 2 bytes per symbol, plus the final states */
+        unsigned char *end = (unsigned char *) tmp.reserve(2 * n + 8) + 2 * n + 8;
+        unsigned char *p = end;
+        uint32_t x[2] = {RANS_L, RANS_L};
+
+        for (size_t i = n; i-- > 0;) {
+            uint32_t &xi = x[i & 1];
+            uint32_t start = syms[i] & 0xffff, freq = syms[i] >> 16;
+            uint32_t x_max = ((RANS_L >> RANS_PROB_BITS) << 8) * freq;
+            while (xi >= x_max) {
+                *--p = (unsigned char) xi;
+                xi >>= 8;
+            }
+            xi = ((xi / freq) << RANS_PROB_BITS) + (xi % freq) + start;
+        }
+        for (int s = 1; s >= 0; s--) {
+            p -= 4;
+            p[0] = x[s] >> 0;
+            p[1] = x[s] >> 8;
+            p[2] = x[s] >> 16;
+            p[3] = x[s] >> 24;
+        }
+
+        out_len = end - p;
+        memcpy(out_buf, p, out_len);
+        syms.release();
+        tmp.release();
+    }
+
+private:
+    GROW_BUF<uint32_t> syms;
+    GROW_BUF<char> tmp;
+    size_t n;
+    char *out_buf;
+    int out_len;
+};
+
+class RANS_DEC {
+public:
+    void input(char *in) { in_buf = (unsigned char *) in; }
+
+    void StartDecode(void) {
+        for (int s = 0; s < 2; s++) {
+            x[s] = in_buf[0] | (in_buf[1] << 8) | (in_buf[2] << 16) | ((uint32_t) in_buf[3] << 24);
+            in_buf += 4;
+        }
+        cur = 0;
+    }
+
+    void FinishDecode(void) {}
+
+    uint GetFreq(uint totFreq) {
+        shift = RANS_PROB_BITS - __builtin_ctz(totFreq);
+        return (x[cur] & ((1u << RANS_PROB_BITS) - 1)) >> shift;
+    }
+
+    void Decode(uint cumFreq, uint freq) {
+        uint32_t xi = x[cur];
+        xi = (freq << shift) * (xi >> RANS_PROB_BITS) + (xi & ((1u << RANS_PROB_BITS) - 1)) - (cumFreq << shift);
+        while (xi < RANS_L)
+            xi = (xi << 8) | *in_buf++;
+        x[cur] = xi;
+        cur ^= 1;
+    }
+
+private:
+    uint32_t x[2];
+    int cur;
+    uint shift;
+    unsigned char *in_buf;
+};
+
+#endif //ENANO_RANS_H
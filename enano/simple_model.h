@@ -19,29 +19,37 @@
 
 #define MAX_FREQ ((1<<16)-32)
 
+/* Bits of the smallest power of two holding n */
+static constexpr int ceil_log2(int n) {
+    return n <= 1 ? 0 : 1 + ceil_log2((n + 1) / 2);
+}
+
 template<int NSYM>
 struct SIMPLE_MODEL {
     enum {
-        STEP = 8
+        STEP = 8,
+        // About one bucket per symbol, the small models don't carry a full table
+        LUT_BITS = MIN(ceil_log2(NSYM), DEC_LUT_BITS)
     };
 
     SIMPLE_MODEL();
     
     inline void reset(); 
 
-    inline void encodeSymbol(RangeCoder *rc, uint16_t sym);
-    inline void encodeSymbolOrder(RangeCoder *rc, uint16_t sym);
-    inline void encodeSymbolNoUpdate(RangeCoder *rc, uint16_t sym);
+    template <class RC> inline void encodeSymbol(RC *rc, uint16_t sym);
+    template <class RC> inline void encodeSymbolOrder(RC *rc, uint16_t sym);
+    template <class RC> inline void encodeSymbolNoUpdate(RC *rc, uint16_t sym);
 
     inline void updateModelAccFrecs(bool decode);
+    inline void updateModelRans(bool decode);
 
     static int compare(const void* a, const void* b);
 
-    inline void mix_array(void**models, uc len);
+    inline void mix_array(SIMPLE_MODEL **models, uint idx, uint len);
 
-    inline uint16_t decodeSymbol(RangeCoder *rc);
-    inline uint16_t decodeSymbolOrder(RangeCoder *rc);
-    inline uint16_t decodeSymbolNoUpdate(RangeCoder *rc);
+    template <class RC> inline uint16_t decodeSymbol(RC *rc);
+    template <class RC> inline uint16_t decodeSymbolOrder(RC *rc);
+    template <class RC> inline uint16_t decodeSymbolNoUpdate(RC *rc);
 
 //protected:
     void normalize();
@@ -55,6 +63,10 @@ struct SIMPLE_MODEL {
         uint16_t Freq;
         uint32_t AccFreq;
     } sentinel, F[NSYM + 1];
+
+    // Frozen decoder: first symbol of each bucket of 1 << LutShift frequencies
+    uint8_t Lut[1 << LUT_BITS];
+    uint8_t LutShift;
 };
 
 
@@ -100,7 +112,8 @@ void SIMPLE_MODEL<NSYM>::normalize() {
 }
 
 template<int NSYM>
-inline void SIMPLE_MODEL<NSYM>::encodeSymbol(RangeCoder *rc, uint16_t sym) {
+template<class RC>
+inline void SIMPLE_MODEL<NSYM>::encodeSymbol(RC *rc, uint16_t sym) {
     SymFreqs *s = F;
     uint32_t AccFreq = 0;
 
@@ -116,7 +129,8 @@ inline void SIMPLE_MODEL<NSYM>::encodeSymbol(RangeCoder *rc, uint16_t sym) {
 }
 
 template<int NSYM>
-inline void SIMPLE_MODEL<NSYM>::encodeSymbolOrder(RangeCoder *rc, uint16_t sym) {
+template<class RC>
+inline void SIMPLE_MODEL<NSYM>::encodeSymbolOrder(RC *rc, uint16_t sym) {
     SymFreqs *s = F;
     uint32_t AccFreq = 0;
 
@@ -139,7 +153,8 @@ inline void SIMPLE_MODEL<NSYM>::encodeSymbolOrder(RangeCoder *rc, uint16_t sym)
 }
 
 template<int NSYM>
-inline void SIMPLE_MODEL<NSYM>::encodeSymbolNoUpdate(RangeCoder *rc, uint16_t sym) {
+template<class RC>
+inline void SIMPLE_MODEL<NSYM>::encodeSymbolNoUpdate(RC *rc, uint16_t sym) {
 #ifdef __ORDER_SYMBOLS__
     SymFreqs *s = F;
 
@@ -152,20 +167,28 @@ inline void SIMPLE_MODEL<NSYM>::encodeSymbolNoUpdate(RangeCoder *rc, uint16_t sy
 #endif
 }
 
+/*
+ * Averages the models idx of the len model arrays by symbol, as the ordered
+ * models of max compression mode keep their symbols in different positions.
+ * The mixed model keeps its own order.
+ */
 template<int NSYM>
-inline void SIMPLE_MODEL<NSYM>::mix_array(void**models, uc len)
+inline void SIMPLE_MODEL<NSYM>::mix_array(SIMPLE_MODEL<NSYM> **models, uint idx, uint len)
 {
+    uint fmix[NSYM];
+    memset(fmix, 0, sizeof(fmix));
+    for (uint c = 0; c < len; c++) {
+        const SymFreqs *m = models[c][idx].F;
+        for (int i = 0; i < NSYM; i++)
+            fmix[m[i].Symbol] += m[i].Freq;
+    }
+
     TotFreq = 0;
     for (int i = 0; i < NSYM; i++) {
-        uint fmix = 0;
-        for (uc c = 0; c < len; c++) {
-            fmix += ((SIMPLE_MODEL<NSYM> *) models[c])->F[i].Freq;
-        }
-        fmix = round((double)fmix/len);
-        F[i].Freq = fmix;
-        TotFreq += fmix;
+        uint f = MIX_ROUND(fmix[F[i].Symbol], len);
+        F[i].Freq = f;
+        TotFreq += f;
     }
-
 }
 
 template<int NSYM>
@@ -189,6 +212,19 @@ inline void SIMPLE_MODEL<NSYM>::updateModelAccFrecs(bool decode) {
         for (int i = 1; i < NSYM; i++) {
             F[i].AccFreq = F[i - 1].AccFreq + F[i].Freq;
         }
+
+        /* The decoder starts the search for the symbol of freq at
+         * Lut[freq >> LutShift], the first symbol ending after that bucket
+         * starts. Buckets are a power of two wide so TotFreq takes at most
+         * 1 << LUT_BITS of them. */
+        int tot_bits = 32 - __builtin_clz(MAX(TotFreq, 2u) - 1);
+        LutShift = MAX(tot_bits - LUT_BITS, 0);
+        int s = 0;
+        for (uint32_t b = 0; b < (1u << LUT_BITS); b++) {
+            while (s < NSYM - 1 && F[s].AccFreq <= (b << LutShift))
+                s++;
+            Lut[b] = s;
+        }
     } else {
         F[0].AccFreq = 0;
         for (int i = 1; i < NSYM; i++) {
@@ -197,8 +233,26 @@ inline void SIMPLE_MODEL<NSYM>::updateModelAccFrecs(bool decode) {
     }
 }
 
+/*
+ * Normalises the frequencies to 1 << RANS_PROB_BITS for the static rANS coder
+ * and sets the accumulated ones.
+ */
 template<int NSYM>
-inline uint16_t SIMPLE_MODEL<NSYM>::decodeSymbol(RangeCoder *rc) {
+inline void SIMPLE_MODEL<NSYM>::updateModelRans(bool decode) {
+    uint32_t f[NSYM];
+    for (int i = 0; i < NSYM; i++)
+        f[i] = F[i].Freq;
+    rans_normalize(f, NSYM, 1u << RANS_PROB_BITS);
+    for (int i = 0; i < NSYM; i++)
+        F[i].Freq = f[i];
+    TotFreq = 1u << RANS_PROB_BITS;
+
+    updateModelAccFrecs(decode);
+}
+
+template<int NSYM>
+template<class RC>
+inline uint16_t SIMPLE_MODEL<NSYM>::decodeSymbol(RC *rc) {
     SymFreqs *s = F;
     uint32_t freq = rc->GetFreq(TotFreq);
     uint32_t AccFreq;
@@ -217,7 +271,8 @@ inline uint16_t SIMPLE_MODEL<NSYM>::decodeSymbol(RangeCoder *rc) {
 }
 
 template<int NSYM>
-inline uint16_t SIMPLE_MODEL<NSYM>::decodeSymbolOrder(RangeCoder *rc) {
+template<class RC>
+inline uint16_t SIMPLE_MODEL<NSYM>::decodeSymbolOrder(RC *rc) {
     SymFreqs *s = F;
     uint32_t freq = rc->GetFreq(TotFreq);
     uint32_t AccFreq;
@@ -244,11 +299,10 @@ inline uint16_t SIMPLE_MODEL<NSYM>::decodeSymbolOrder(RangeCoder *rc) {
 }
 
 template<int NSYM>
-inline uint16_t SIMPLE_MODEL<NSYM>::decodeSymbolNoUpdate(RangeCoder *rc) {
-
-
+template<class RC>
+inline uint16_t SIMPLE_MODEL<NSYM>::decodeSymbolNoUpdate(RC *rc) {
     uint32_t freq = rc->GetFreq(TotFreq);
-    SymFreqs *s = F;
+    SymFreqs *s = F + Lut[freq >> LutShift];
 
     for (; s->AccFreq <= freq; s++);
 